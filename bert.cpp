@@ -17,12 +17,34 @@ https://github.com/xyzhang626/embeddings.cpp
 #include "ggml-metal.h"
 #endif
 
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <climits>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
 #define BERT_MAX_NODES 4096
 
 // model keys
@@ -202,7 +224,13 @@ const char* bert_vocab_id_to_token(bert_ctx * ctx, bert_token id) {
     return "[UNK TOKEN from bert_vocab]";
 }
 
+// defined with the latency histograms
+static void bert_metrics_observe(bert_atomic_histogram * hist, int64_t value);
+
 bert_tokens bert_tokenize(struct bert_ctx * ctx, bert_string text, uint64_t n_max_tokens) {
+    bert_trace_span span("tokenize", "tokenizer");
+    span.arg("bytes", text.size());
+
     int cls_tok_id = 101;
     int sep_tok_id = 102;
     int unk_tok_id = 100;
@@ -306,6 +334,7 @@ bert_tokens bert_tokenize(struct bert_ctx * ctx, bert_string text, uint64_t n_ma
 
     // append terminate token
     tokens.push_back(sep_tok_id);
+    span.arg("tokens", tokens.size());
 
     // return tokens
     return tokens;
@@ -313,14 +342,64 @@ bert_tokens bert_tokenize(struct bert_ctx * ctx, bert_string text, uint64_t n_ma
 
 // c-string interface to tokenizer
 uint64_t bert_tokenize_c(struct bert_ctx * ctx, const char * text, int32_t * output, uint64_t n_max_tokens) {
+    const int64_t t_start_us = ggml_time_us();
     bert_string str(text);
     bert_tokens tokens = bert_tokenize(ctx, str, n_max_tokens);
+    bert_metrics_observe_phase(ctx, BERT_PHASE_TOKENIZE, ggml_time_us() - t_start_us);
     for (uint64_t i = 0; i < tokens.size(); ++i) {
         output[i] = tokens[i];
     }
     return tokens.size();
 }
 
+int64_t bert_tokenize_batch_c(struct bert_ctx * ctx, const char * buf, const int64_t * offsets, int32_t n_input, uint64_t n_max_tokens, int32_t * ids, int64_t capacity, int64_t * ids_offsets, int32_t n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+    n_threads = std::max(1, std::min(n_threads, n_input));
+
+    // each thread tokenizes a contiguous range into its own flat buffer
+    std::vector<std::vector<int32_t>> flat(n_threads);
+    std::vector<int64_t> lengths(n_input);
+    auto worker = [&](int32_t t) {
+        const int32_t i0 = (int64_t) n_input * t / n_threads;
+        const int32_t i1 = (int64_t) n_input * (t + 1) / n_threads;
+        for (int32_t i = i0; i < i1; i++) {
+            bert_string text(buf + offsets[i], offsets[i + 1] - offsets[i]);
+            bert_tokens tokens = bert_tokenize(ctx, text, n_max_tokens);
+            flat[t].insert(flat[t].end(), tokens.begin(), tokens.end());
+            lengths[i] = tokens.size();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int32_t t = 1; t < n_threads; t++) {
+        threads.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto & thread : threads) {
+        thread.join();
+    }
+    bert_metrics_observe_phase(ctx, BERT_PHASE_TOKENIZE, ggml_time_us() - t_start_us);
+
+    int64_t n_total = 0;
+    for (const auto & f : flat) {
+        n_total += f.size();
+    }
+    if (n_total > capacity) {
+        return n_total;
+    }
+
+    ids_offsets[0] = 0;
+    for (int32_t i = 0; i < n_input; i++) {
+        ids_offsets[i + 1] = ids_offsets[i] + lengths[i];
+    }
+    for (const auto & f : flat) {
+        std::copy(f.begin(), f.end(), ids);
+        ids += f.size();
+    }
+
+    return n_total;
+}
+
 //
 // bert model
 //
@@ -333,11 +412,213 @@ int32_t bert_n_max_tokens(bert_ctx * ctx) {
     return ctx->model.hparams.n_max_tokens;
 }
 
+int32_t bert_n_vocab(bert_ctx * ctx) {
+    return ctx->model.hparams.n_vocab;
+}
+
+// raw ids from callers index the embedding table, so anything outside the vocab is refused
+static bool bert_tokens_valid(bert_ctx * ctx, const bert_token * ids, int64_t n_tokens) {
+    const int32_t n_vocab = bert_n_vocab(ctx);
+    for (int64_t i = 0; i < n_tokens; i++) {
+        if (ids[i] < 0 || ids[i] >= n_vocab) {
+            fprintf(stderr, "%s: token id %d out of range (vocab size is %d)\n", __func__, ids[i], n_vocab);
+            return false;
+        }
+    }
+    return true;
+}
+
 //
 // loading and setup
 //
 
 struct bert_ctx * bert_load_from_file(const char *fname, bool use_cpu) {
+    bert_load_params params;
+    params.use_cpu = use_cpu;
+    return bert_load_from_file_ext(fname, params);
+}
+
+// map the whole file read-only, returns NULL on failure
+static void * bert_mmap_file(const char * fname, size_t * size) {
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void * addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return addr;
+}
+
+// lock as much as RLIMIT_MEMLOCK permits, raising the soft limit to the hard one first
+static size_t bert_mlock_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) != 0) {
+        return 0;
+    }
+    if (rl.rlim_cur != rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_MEMLOCK, &rl);
+        getrlimit(RLIMIT_MEMLOCK, &rl);
+    }
+    return rl.rlim_cur == RLIM_INFINITY ? SIZE_MAX : (size_t) rl.rlim_cur;
+}
+
+// pin the weights in one go, or tensor by tensor once the whole does not fit
+static void bert_mlock_weights(bert_ctx * ctx) {
+    void * base = ctx->mmap_addr;
+    size_t size = ctx->mmap_size;
+    if (!base && ctx->weights_buffer && ggml_backend_buffer_is_host(ctx->weights_buffer)) {
+        base = ggml_backend_buffer_get_base(ctx->weights_buffer);
+        size = ggml_backend_buffer_get_size(ctx->weights_buffer);
+    }
+    if (!base) {
+        fprintf(stderr, "%s: weights are not in host memory, nothing to lock\n", __func__);
+        return;
+    }
+
+    const size_t limit = bert_mlock_limit();
+    if (mlock(base, size) == 0) {
+        ctx->mlock_weights.emplace_back(base, size);
+        ctx->mlock_weights_bytes = size;
+    } else {
+        for (ggml_tensor * cur = ggml_get_first_tensor(ctx->ctx_data); cur; cur = ggml_get_next_tensor(ctx->ctx_data, cur)) {
+            const size_t n_bytes = ggml_nbytes(cur);
+            if (mlock(cur->data, n_bytes) == 0) {
+                ctx->mlock_weights.emplace_back(cur->data, n_bytes);
+                ctx->mlock_weights_bytes += n_bytes;
+            }
+        }
+    }
+
+    if (ctx->mlock_weights_bytes < size) {
+        fprintf(stderr, "%s: locked %.2f of %.2f MB of weights, RLIMIT_MEMLOCK is %.2f MB (raise it with ulimit -l)\n", __func__,
+            ctx->mlock_weights_bytes / 1024.0 / 1024.0, size / 1024.0 / 1024.0, limit == SIZE_MAX ? INFINITY : limit / 1024.0 / 1024.0);
+    } else if (verbosity >= 1) {
+        fprintf(stderr, "%s: locked %.2f MB of weights\n", __func__, size / 1024.0 / 1024.0);
+    }
+}
+
+// page range covering a set of mapped tensors
+static std::pair<void *, size_t> bert_tensor_span(std::initializer_list<const ggml_tensor *> tensors) {
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t lo = UINTPTR_MAX;
+    uintptr_t hi = 0;
+    for (const ggml_tensor * t : tensors) {
+        lo = std::min(lo, (uintptr_t) t->data);
+        hi = std::max(hi, (uintptr_t) t->data + ggml_nbytes(t));
+    }
+    if (lo >= hi) {
+        return {nullptr, 0};
+    }
+    lo &= ~(page - 1);
+    hi = (hi + page - 1) & ~(page - 1);
+    return {(void *) lo, hi - lo};
+}
+
+// weights read by each stage of the graph, in the order bert_build_graph expands them
+static void bert_stage_weights(bert_ctx * ctx) {
+    const bert_model & model = ctx->model;
+
+    ctx->stage_weights.push_back(bert_tensor_span({
+        model.word_embeddings, model.token_type_embeddings, model.position_embeddings, model.ln_e_w, model.ln_e_b,
+    }));
+    for (const bert_layer & layer : model.layers) {
+        ctx->stage_weights.push_back(bert_tensor_span({
+            layer.ln_att_w, layer.ln_att_b, layer.ln_out_w, layer.ln_out_b,
+            layer.q_w, layer.q_b, layer.k_w, layer.k_b, layer.v_w, layer.v_b, layer.o_w, layer.o_b,
+            layer.ff_i_w, layer.ff_i_b, layer.ff_o_w, layer.ff_o_b,
+        }));
+    }
+    ctx->stage_weights.push_back({nullptr, 0}); // pooling reads no weights
+}
+
+size_t bert_locked_bytes(bert_ctx * ctx) {
+    return ctx->mlock_weights_bytes + ctx->mlock_compute_bytes;
+}
+
+// heap footprint of a string, short ones live inside the object
+static int64_t bert_string_bytes(const std::string & str) {
+    return sizeof(std::string) + (str.capacity() > 15 ? str.capacity() + 1 : 0);
+}
+
+// a red-black tree node is four pointer-sized header words plus the value
+template <typename K, typename V>
+static int64_t bert_map_bytes(const std::map<K, V> & map) {
+    int64_t bytes = sizeof(map) + map.size() * (4 * sizeof(void *) + sizeof(std::pair<const K, V>));
+    for (const auto & it : map) {
+        if constexpr (std::is_same_v<K, std::string>) bytes += bert_string_bytes(it.first) - sizeof(std::string);
+        if constexpr (std::is_same_v<V, std::string>) bytes += bert_string_bytes(it.second) - sizeof(std::string);
+    }
+    return bytes;
+}
+
+void bert_get_memory(bert_ctx * ctx, bert_memory * memory) {
+    *memory = bert_memory();
+
+    for (ggml_tensor * t = ggml_get_first_tensor(ctx->ctx_data); t != NULL; t = ggml_get_next_tensor(ctx->ctx_data, t)) {
+        memory->weights_by_type[ggml_type_name(t->type)] += ggml_nbytes(t);
+        memory->weights_bytes += ggml_nbytes(t);
+    }
+    memory->weights_mapped = ctx->mmap_addr != NULL;
+    memory->tensor_meta_bytes = ggml_get_mem_size(ctx->ctx_data);
+
+    const bert_vocab & vocab = ctx->vocab;
+    memory->vocab_bytes = vocab.tokens.capacity() * sizeof(std::string);
+    for (const auto & token : vocab.tokens) {
+        memory->vocab_bytes += bert_string_bytes(token) - sizeof(std::string);
+    }
+    memory->vocab_bytes += bert_map_bytes(vocab.token_to_id) + bert_map_bytes(vocab.subword_token_to_id);
+    memory->vocab_bytes += bert_map_bytes(vocab._id_to_token) + bert_map_bytes(vocab._id_to_subword_token);
+
+    if (ctx->compute_buffer) {
+        memory->compute_bytes = ggml_backend_buffer_get_size(ctx->compute_buffer);
+        memory->compute_peak_bytes = ctx->compute_peak.load(std::memory_order_relaxed);
+        memory->compute_n_max_tokens = ctx->buf_n_max_tokens;
+        memory->compute_batch_size = ctx->buf_batch_size;
+    }
+    memory->graph_meta_bytes = ctx->buf_compute_meta.capacity();
+
+    // a forward stages the token ids, types, positions, padding mask and pooling weights,
+    // each one int32 or f32 per padded token, and receives a copy of the batch
+    const int64_t n_padded = (int64_t) ctx->buf_batch_size * ctx->buf_n_max_tokens;
+    const int64_t n_output = (int64_t) ctx->buf_batch_size * bert_n_embd(ctx) * sizeof(float);
+    memory->staging_bytes = 6 * n_padded * sizeof(int32_t);
+    if (ctx->batcher) {
+        memory->staging_bytes += n_output;
+    }
+    if (ctx->completion) {
+        memory->staging_bytes += n_output + ctx->buf_batch_size * (sizeof(uint64_t) + sizeof(int32_t));
+    }
+
+    memory->locked_bytes = bert_locked_bytes(ctx);
+
+    // mapped weights are counted once here, whatever the page cache shares with others
+    memory->total_bytes = memory->weights_bytes + memory->tensor_meta_bytes + memory->vocab_bytes +
+        memory->compute_bytes + memory->graph_meta_bytes + memory->staging_bytes;
+}
+
+// false for the weights of encoder layers at or past n_layer
+static bool bert_tensor_kept(const char * name, int32_t n_layer) {
+    static const char prefix[] = "encoder.layer.";
+    if (strncmp(name, prefix, sizeof(prefix) - 1) != 0) {
+        return true;
+    }
+    return atoi(name + sizeof(prefix) - 1) < n_layer;
+}
+
+struct bert_ctx * bert_load_from_file_ext(const char *fname, bert_load_params params) {
     struct ggml_context * ctx_ggml = NULL;
 
     struct gguf_init_params gguf_params = {
@@ -375,6 +656,7 @@ struct bert_ctx * bert_load_from_file(const char *fname, bool use_cpu) {
 
     // create model object
     bert_ctx * new_bert = new bert_ctx;
+    new_bert->params = params;
     bert_model & model = new_bert->model;
     bert_vocab & vocab = new_bert->vocab;
     bert_hparams & hparams = model.hparams;
@@ -399,6 +681,14 @@ struct bert_ctx * bert_load_from_file(const char *fname, bool use_cpu) {
             fprintf(stderr, "%s: layer_norm_eps = %g\n", __func__, hparams.layer_norm_eps);
             fprintf(stderr, "\n");
         }
+
+        // layer truncation, pooling then reads the output of the last kept layer
+        if (params.n_layer > 0 && params.n_layer < hparams.n_layer) {
+            if (verbosity >= 1) {
+                fprintf(stderr, "%s: keeping %d of %d layers\n\n", __func__, params.n_layer, hparams.n_layer);
+            }
+            hparams.n_layer = params.n_layer;
+        }
     }
 
     // load vocab
@@ -429,6 +719,9 @@ struct bert_ctx * bert_load_from_file(const char *fname, bool use_cpu) {
             const char * name = gguf_get_tensor_name(ctx_gguf, i);
             const size_t offset = gguf_get_tensor_offset(ctx_gguf, i);
             struct ggml_tensor * cur = ggml_get_tensor(ctx_ggml, name);
+            if (!bert_tensor_kept(name, hparams.n_layer)) {
+                continue;
+            }
             size_t tensor_size = ggml_nbytes(cur);
             buffer_size += tensor_size;
             if (verbosity >= 2) {
@@ -440,7 +733,7 @@ struct bert_ctx * bert_load_from_file(const char *fname, bool use_cpu) {
 
     // initialize advanced backend
 #ifdef GGML_USE_CUBLAS
-    if (!use_cpu) {
+    if (!params.use_cpu) {
         new_bert->backend = ggml_backend_cuda_init(0);
         if (!new_bert->backend) {
             fprintf(stderr, "%s: ggml_backend_cuda_init() failed\n", __func__);
@@ -483,57 +776,107 @@ struct bert_ctx * bert_load_from_file(const char *fname, bool use_cpu) {
             return nullptr;
         }
 
-        // open model gguf file
-        auto fin = std::ifstream(fname, std::ios::binary);
-        if (!fin) {
-            fprintf(stderr, "cannot open model file for loading tensors\n");
-            delete new_bert;
-            return nullptr;
-        }
-
         // add tensors to our context
         for (int i = 0; i < n_tensors; ++i) {
             const char * name = gguf_get_tensor_name(ctx_gguf, i);
+            if (!bert_tensor_kept(name, hparams.n_layer)) {
+                continue;
+            }
             struct ggml_tensor * ten = ggml_get_tensor(ctx_ggml, name);
             struct ggml_tensor * cur = ggml_dup_tensor(new_bert->ctx_data, ten);
             ggml_set_name(cur, name);
         }
 
-        // create params buffer and allocr
-        new_bert->weights_buffer = ggml_backend_alloc_buffer(new_bert->backend, buffer_size);
-        ggml_allocr * alloc = ggml_allocr_new_from_buffer(new_bert->weights_buffer);
+        // streaming works on the mapping, and pinned pages cannot be dropped
+        if (params.stream_layers) {
+            new_bert->params.use_mmap = true;
+            if (params.use_mlock) {
+                fprintf(stderr, "%s: layer streaming and mlock exclude each other, not locking weights\n", __func__);
+                new_bert->params.use_mlock = false;
+            }
+        }
 
-        // loop over tensors and load in
-        for (int i = 0; i < n_tensors; ++i) {
-            // do the actual allocation on the backend
-            const char * name = gguf_get_tensor_name(ctx_gguf, i);
-            struct ggml_tensor * cur = ggml_get_tensor(new_bert->ctx_data, name);
-            ggml_allocr_alloc(alloc, cur);
+        // weights can only be mapped in place when the backend reads host memory
+        if (new_bert->params.use_mmap && !ggml_backend_is_cpu(new_bert->backend)) {
+            fprintf(stderr, "%s: mmap is only supported on the CPU backend, reading weights instead\n", __func__);
+            new_bert->params.use_mmap = false;
+            new_bert->params.stream_layers = false;
+        }
 
-            // seek to the tensor data in the file
-            const size_t offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i);
-            fin.seekg(offset, std::ios::beg);
-            if (!fin) {
-                fprintf(stderr, "%s: failed to seek for tensor %s\n", __func__, name);
+        if (new_bert->params.use_mmap) {
+            new_bert->mmap_addr = bert_mmap_file(fname, &new_bert->mmap_size);
+            if (!new_bert->mmap_addr) {
+                fprintf(stderr, "%s: failed to mmap %s\n", __func__, fname);
                 bert_free(new_bert);
                 return nullptr;
             }
 
-            // read in data and copy to device if needed
-            int num_bytes = ggml_nbytes(cur);
-            if (ggml_backend_buffer_is_host(new_bert->weights_buffer)) {
-                // for the CPU and Metal backend, we can read directly into the tensor
-                fin.read(reinterpret_cast<char *>(cur->data), num_bytes);
-            } else {
-                // read into a temporary buffer first, then copy to device memory
-                read_buf.resize(num_bytes);
-                fin.read(reinterpret_cast<char *>(read_buf.data()), num_bytes);
-                ggml_backend_tensor_set(cur, read_buf.data(), 0, num_bytes);
+            // tensors point straight into the mapping, which the weights buffer wraps
+            new_bert->weights_buffer = ggml_backend_cpu_buffer_from_ptr(new_bert->mmap_addr, new_bert->mmap_size);
+            uint8_t * data = (uint8_t *) new_bert->mmap_addr + gguf_get_data_offset(ctx_gguf);
+            for (int i = 0; i < n_tensors; ++i) {
+                const char * name = gguf_get_tensor_name(ctx_gguf, i);
+                struct ggml_tensor * cur = ggml_get_tensor(new_bert->ctx_data, name);
+                if (cur == NULL) {
+                    continue; // layer dropped by truncation
+                }
+                const size_t offset = gguf_get_tensor_offset(ctx_gguf, i);
+                if (gguf_get_data_offset(ctx_gguf) + offset + ggml_nbytes(cur) > new_bert->mmap_size) {
+                    fprintf(stderr, "%s: tensor %s extends past the end of the file\n", __func__, name);
+                    bert_free(new_bert);
+                    return nullptr;
+                }
+                cur->data = data + offset;
+                cur->buffer = new_bert->weights_buffer;
             }
-        }
+        } else {
+            // open model gguf file
+            auto fin = std::ifstream(fname, std::ios::binary);
+            if (!fin) {
+                fprintf(stderr, "cannot open model file for loading tensors\n");
+                delete new_bert;
+                return nullptr;
+            }
+
+            // create params buffer and allocr
+            new_bert->weights_buffer = ggml_backend_alloc_buffer(new_bert->backend, buffer_size);
+            ggml_allocr * alloc = ggml_allocr_new_from_buffer(new_bert->weights_buffer);
+
+            // loop over tensors and load in
+            for (int i = 0; i < n_tensors; ++i) {
+                // do the actual allocation on the backend
+                const char * name = gguf_get_tensor_name(ctx_gguf, i);
+                struct ggml_tensor * cur = ggml_get_tensor(new_bert->ctx_data, name);
+                if (cur == NULL) {
+                    continue; // layer dropped by truncation
+                }
+                ggml_allocr_alloc(alloc, cur);
+
+                // seek to the tensor data in the file
+                const size_t offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i);
+                fin.seekg(offset, std::ios::beg);
+                if (!fin) {
+                    fprintf(stderr, "%s: failed to seek for tensor %s\n", __func__, name);
+                    bert_free(new_bert);
+                    return nullptr;
+                }
 
-        // bye bye allocr
-        ggml_allocr_free(alloc);
+                // read in data and copy to device if needed
+                int num_bytes = ggml_nbytes(cur);
+                if (ggml_backend_buffer_is_host(new_bert->weights_buffer)) {
+                    // for the CPU and Metal backend, we can read directly into the tensor
+                    fin.read(reinterpret_cast<char *>(cur->data), num_bytes);
+                } else {
+                    // read into a temporary buffer first, then copy to device memory
+                    read_buf.resize(num_bytes);
+                    fin.read(reinterpret_cast<char *>(read_buf.data()), num_bytes);
+                    ggml_backend_tensor_set(cur, read_buf.data(), 0, num_bytes);
+                }
+            }
+
+            // bye bye allocr
+            ggml_allocr_free(alloc);
+        }
     }
 
     // use get_tensors to populate bert_model
@@ -578,6 +921,14 @@ struct bert_ctx * bert_load_from_file(const char *fname, bool use_cpu) {
         }
     }
 
+    if (new_bert->params.stream_layers) {
+        bert_stage_weights(new_bert);
+    }
+
+    if (new_bert->params.use_mlock) {
+        bert_mlock_weights(new_bert);
+    }
+
     // free metadata
     ggml_free(ctx_ggml);
     gguf_free(ctx_gguf);
@@ -611,12 +962,29 @@ void bert_allocate_buffers(bert_ctx * ctx, int32_t n_max_tokens, int32_t batch_s
     ctx->compute_buffer = ggml_backend_alloc_buffer(ctx->backend, compute_memory_buffer_size);
     ctx->compute_alloc = ggml_allocr_new_from_buffer(ctx->compute_buffer);
 
+    // pin the compute buffer too if asked, a failure here only costs latency
+    if (ctx->params.mlock_compute && ggml_backend_buffer_is_host(ctx->compute_buffer)) {
+        if (mlock(ggml_backend_buffer_get_base(ctx->compute_buffer), compute_memory_buffer_size) == 0) {
+            ctx->mlock_compute_bytes = compute_memory_buffer_size;
+        } else {
+            fprintf(stderr, "%s: failed to lock %.2f MB of compute buffer: %s\n", __func__, compute_memory_buffer_size / 1024.0 / 1024.0, strerror(errno));
+        }
+    }
+
+    // remember the worst case shape so the batcher never exceeds it
+    ctx->buf_n_max_tokens = n_max_tokens;
+    ctx->buf_batch_size = batch_size;
+
     if (verbosity >= 1) {
         fprintf(stderr, "%s: compute allocated memory: %.2f MB\n\n", __func__, compute_memory_buffer_size / 1024.0 / 1024.0);
     }
 }
 
 void bert_deallocate_buffers(bert_ctx * ctx) {
+    if (ctx->mlock_compute_bytes) {
+        munlock(ggml_backend_buffer_get_base(ctx->compute_buffer), ctx->mlock_compute_bytes);
+        ctx->mlock_compute_bytes = 0;
+    }
     if (ctx->compute_buffer) {
         ggml_backend_buffer_free(ctx->compute_buffer);
         ctx->compute_buffer = NULL;
@@ -625,18 +993,38 @@ void bert_deallocate_buffers(bert_ctx * ctx) {
         ggml_allocr_free(ctx->compute_alloc);
         ctx->compute_alloc = NULL;
     }
+    ctx->compute_peak = 0;
 }
 
+static void bert_completion_free(bert_ctx * ctx);
+
 void bert_free(bert_ctx * ctx) {
+    // drain and join the batching worker
+    bert_batcher_stop(ctx);
+    bert_completion_free(ctx);
+
     // free compute buffers
     bert_deallocate_buffers(ctx);
 
+    // unpin before the memory goes back to the allocator
+    for (const auto & region : ctx->mlock_weights) {
+        munlock(region.first, region.second);
+    }
+    ctx->mlock_weights.clear();
+    ctx->mlock_weights_bytes = 0;
+
     // free weights buffer
     if (ctx->weights_buffer) {
         ggml_backend_buffer_free(ctx->weights_buffer);
         ctx->weights_buffer = NULL;
     }
 
+    // unmap the model file once nothing points into it
+    if (ctx->mmap_addr) {
+        munmap(ctx->mmap_addr, ctx->mmap_size);
+        ctx->mmap_addr = NULL;
+    }
+
     // free tensor context
     if (ctx->ctx_data) {
         ggml_free(ctx->ctx_data);
@@ -760,10 +1148,22 @@ ggml_cgraph * bert_build_graph(bert_ctx * ctx, bert_batch batch) {
     inpL = ggml_add(ctx0, ggml_get_rows(ctx0, model.position_embeddings, positions), inpL);
     inpL = ggml_reshape_3d(ctx0, inpL, n_embd, cur_max_len, n_batch_size); // [E, L, B]
 
+    // expand stage by stage (and section by section within) so each one occupies a contiguous run of nodes
+    ctx->stage_nodes.clear();
+    ctx->section_nodes.clear();
+    auto end_section = [&](ggml_tensor * t, bert_section section) {
+        ggml_build_forward_expand(gf, t);
+        ctx->section_nodes.push_back({gf->n_nodes, section});
+    };
+    end_section(inpL, BERT_SECTION_EMBEDDINGS);
+
     // embed layern norm
     inpL = ggml_norm_inplace(ctx0, inpL, layer_norm_eps);
     inpL = ggml_add(ctx0, ggml_mul(ctx0, inpL, model.ln_e_w), model.ln_e_b); // [E, L, B]
 
+    end_section(inpL, BERT_SECTION_NORM);
+    ctx->stage_nodes.push_back(gf->n_nodes);
+
     // layers
     for (int il = 0; il < n_layer; il++) {
         struct ggml_tensor * cur = inpL;
@@ -808,10 +1208,12 @@ ggml_cgraph * bert_build_graph(bert_ctx * ctx, bert_batch batch) {
 
         // residual connection
         cur = ggml_add(ctx0, cur, inpL);
+        end_section(cur, BERT_SECTION_ATTENTION);
 
         // attention layer norm
         cur = ggml_norm_inplace(ctx0, cur, layer_norm_eps);
         cur = ggml_add(ctx0, ggml_mul(ctx0, cur, model.layers[il].ln_att_w), model.layers[il].ln_att_b);
+        end_section(cur, BERT_SECTION_NORM);
 
         // store for later
         struct ggml_tensor * att_output = cur;
@@ -823,6 +1225,7 @@ ggml_cgraph * bert_build_graph(bert_ctx * ctx, bert_batch batch) {
 
         // attentions bypass the intermediate layer
         cur = ggml_add(ctx0, att_output, cur);
+        end_section(cur, BERT_SECTION_FFN);
 
         // output layer norm
         cur = ggml_norm_inplace(ctx0, cur, layer_norm_eps);
@@ -830,6 +1233,8 @@ ggml_cgraph * bert_build_graph(bert_ctx * ctx, bert_batch batch) {
 
         // on to next layer
         inpL = cur;
+        end_section(inpL, BERT_SECTION_NORM);
+        ctx->stage_nodes.push_back(gf->n_nodes);
     }
 
     // pooling (sum = [L, 1, B])
@@ -844,7 +1249,8 @@ ggml_cgraph * bert_build_graph(bert_ctx * ctx, bert_batch batch) {
     ggml_tensor * output = inpL;
 
     // build the graph
-    ggml_build_forward_expand(gf, output);
+    end_section(output, BERT_SECTION_POOLING);
+    ctx->stage_nodes.push_back(gf->n_nodes);
 
     // free context
     ggml_free(ctx0);
@@ -853,19 +1259,424 @@ ggml_cgraph * bert_build_graph(bert_ctx * ctx, bert_batch batch) {
     return gf;
 }
 
+//
+// tracing
+//
+
+struct bert_trace_event {
+    std::string name;
+    const char * cat;
+    int64_t t_start_us;
+    int64_t t_us;
+    uint32_t tid;
+    std::string args;
+};
+
+struct bert_trace {
+    std::mutex mutex;
+    bert_trace_params params;
+    std::vector<bert_trace_event> events;
+    std::map<uint32_t, std::string> thread_names;
+    uint64_t n_dropped = 0;
+};
+
+// checked before doing any tracing work at all
+static std::atomic<bool> g_trace_on{false};
+static std::atomic<bool> g_trace_nodes{false};
+static bert_trace g_trace;
+
+// small sequential ids read better in the timeline than pthread ids
+static uint32_t bert_trace_tid() {
+    static std::atomic<uint32_t> next_tid{1};
+    thread_local uint32_t tid = next_tid++;
+    return tid;
+}
+
+static void bert_trace_add(std::string name, const char * cat, int64_t t_start_us, int64_t t_us, std::string args) {
+    const uint32_t tid = bert_trace_tid();
+    std::lock_guard<std::mutex> lock(g_trace.mutex);
+    if (!g_trace_on.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (g_trace.events.size() >= g_trace.params.max_events) {
+        g_trace.n_dropped++;
+        return;
+    }
+    g_trace.events.push_back({std::move(name), cat, t_start_us, t_us, tid, std::move(args)});
+}
+
+static std::string bert_json_escape(const std::string & str) {
+    std::string out;
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char) c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+bert_trace_span::bert_trace_span(const char * name, const char * cat) : name(name), cat(cat) {
+    if (g_trace_on.load(std::memory_order_relaxed)) {
+        t_start_us = ggml_time_us();
+    }
+}
+
+bert_trace_span::~bert_trace_span() {
+    if (t_start_us >= 0) {
+        bert_trace_add(name, cat, t_start_us, ggml_time_us() - t_start_us, std::move(args));
+    }
+}
+
+void bert_trace_span::arg(const char * key, int64_t value) {
+    if (t_start_us >= 0) {
+        args += (args.empty() ? "\"" : ", \"") + std::string(key) + "\": " + std::to_string(value);
+    }
+}
+
+void bert_trace_start(bert_trace_params params) {
+    std::lock_guard<std::mutex> lock(g_trace.mutex);
+    g_trace.params = params;
+    g_trace.events.clear();
+    g_trace.n_dropped = 0;
+    g_trace_nodes = params.nodes;
+    g_trace_on = true;
+}
+
+bool bert_trace_stop(const char * fname) {
+    std::vector<bert_trace_event> events;
+    std::map<uint32_t, std::string> thread_names;
+    uint64_t n_dropped;
+    {
+        std::lock_guard<std::mutex> lock(g_trace.mutex);
+        g_trace_on = false;
+        g_trace_nodes = false;
+        events.swap(g_trace.events);
+        thread_names.swap(g_trace.thread_names);
+        n_dropped = g_trace.n_dropped;
+    }
+
+    FILE * fout = fopen(fname, "w");
+    if (fout == NULL) {
+        fprintf(stderr, "%s: failed to open '%s' for writing: %s\n", __func__, fname, strerror(errno));
+        return false;
+    }
+
+    const int pid = getpid();
+    fprintf(fout, "{\"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped_events\": %llu}, \"traceEvents\": [\n", (unsigned long long) n_dropped);
+    bool first = true;
+    for (const auto & it : thread_names) {
+        fprintf(fout, "%s{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+            first ? "" : ",\n", pid, it.first, bert_json_escape(it.second).c_str());
+        first = false;
+    }
+    for (const auto & ev : events) {
+        fprintf(fout, "%s{\"ph\": \"X\", \"name\": \"%s\", \"cat\": \"%s\", \"pid\": %d, \"tid\": %u, \"ts\": %lld, \"dur\": %lld, \"args\": {%s}}",
+            first ? "" : ",\n", bert_json_escape(ev.name).c_str(), ev.cat, pid, ev.tid, (long long) ev.t_start_us, (long long) ev.t_us, ev.args.c_str());
+        first = false;
+    }
+    fprintf(fout, "\n]}\n");
+
+    const bool ok = fclose(fout) == 0;
+    if (ok && n_dropped > 0) {
+        fprintf(stderr, "%s: dropped %llu events past max_events\n", __func__, (unsigned long long) n_dropped);
+    }
+    return ok;
+}
+
+void bert_trace_thread_name(const char * name) {
+    if (!g_trace_on.load(std::memory_order_relaxed)) {
+        return;
+    }
+    const uint32_t tid = bert_trace_tid();
+    std::lock_guard<std::mutex> lock(g_trace.mutex);
+    g_trace.thread_names[tid] = name;
+}
+
+//
+// profiling
+//
+
+const char * bert_section_name(bert_section section) {
+    switch (section) {
+        case BERT_SECTION_EMBEDDINGS: return "embeddings";
+        case BERT_SECTION_ATTENTION:  return "attention";
+        case BERT_SECTION_FFN:        return "ffn";
+        case BERT_SECTION_NORM:       return "norm";
+        case BERT_SECTION_POOLING:    return "pooling";
+        default:                      return "unknown";
+    }
+}
+
+void bert_profile_enable(struct bert_ctx * ctx, bool enable) {
+    ctx->profiling = enable;
+}
+
+void bert_profile_reset(struct bert_ctx * ctx) {
+    std::lock_guard<std::mutex> lock(ctx->profile_mutex);
+    ctx->profile = bert_profile();
+}
+
+void bert_profile_get(struct bert_ctx * ctx, bert_profile * profile) {
+    std::lock_guard<std::mutex> lock(ctx->profile_mutex);
+    *profile = ctx->profile;
+}
+
+// run nodes [i0, i1) of the graph, one node at a time with a timestamp around each when
+// profiling or tracing nodes
+static void bert_compute_nodes(bert_ctx * ctx, ggml_cgraph * gf, int i0, int i1, std::vector<int64_t> * node_us) {
+    if (node_us == nullptr) {
+        struct ggml_cgraph view = ggml_graph_view(gf, i0, i1);
+        ggml_backend_graph_compute(ctx->backend, &view);
+        return;
+    }
+
+    const bool trace_nodes = g_trace_nodes.load(std::memory_order_relaxed);
+    for (int i = i0; i < i1; i++) {
+        const int64_t t_start_us = ggml_time_us();
+        struct ggml_cgraph view = ggml_graph_view(gf, i, i + 1);
+        ggml_backend_graph_compute(ctx->backend, &view);
+        ggml_backend_synchronize(ctx->backend);
+        (*node_us)[i] = ggml_time_us() - t_start_us;
+
+        if (trace_nodes) {
+            const ggml_tensor * node = gf->nodes[i];
+            bert_trace_add(ggml_op_desc(node), "op", t_start_us, (*node_us)[i],
+                "\"node\": " + std::to_string(i) + ", \"ne0\": " + std::to_string(node->ne[0]) + ", \"ne1\": " + std::to_string(node->ne[1]));
+        }
+    }
+}
+
+//
+// hardware counters
+//
+
+struct bert_perf {
+    int fds[BERT_COUNTER_COUNT];
+};
+
+#ifdef __linux__
+// counts the calling thread and, through inherit, the compute threads it spawns, which are
+// folded in once they exit. user space only, so it works with perf_event_paranoid up to 2
+static bool bert_perf_open(bert_perf * perf) {
+    static const std::pair<uint32_t, uint64_t> events[BERT_COUNTER_COUNT] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    };
+
+    for (int i = 0; i < BERT_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].first;
+        attr.config = events[i].second;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (perf->fds[i] < 0) {
+            for (int j = 0; j < i; j++) {
+                close(perf->fds[j]);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+// totals so far, scaled up when the kernel had to multiplex the counters
+static void bert_perf_read(const bert_perf * perf, uint64_t * values) {
+    for (int i = 0; i < BERT_COUNTER_COUNT; i++) {
+        uint64_t data[3] = {0, 0, 0}; // value, time enabled, time running
+        values[i] = 0;
+        if (read(perf->fds[i], data, sizeof(data)) == sizeof(data) && data[2] > 0) {
+            values[i] = data[2] < data[1] ? (uint64_t) ((double) data[0] * data[1] / data[2]) : data[0];
+        }
+    }
+}
+
+static void bert_perf_close(bert_perf * perf) {
+    for (int i = 0; i < BERT_COUNTER_COUNT; i++) {
+        close(perf->fds[i]);
+    }
+}
+#else
+static bool bert_perf_open(bert_perf *) { return false; }
+static void bert_perf_read(const bert_perf *, uint64_t * values) { memset(values, 0, BERT_COUNTER_COUNT * sizeof(uint64_t)); }
+static void bert_perf_close(bert_perf *) {}
+#endif
+
+bool bert_profile_enable_counters(struct bert_ctx * ctx, bool enable) {
+    if (enable) {
+        if (!ggml_backend_is_cpu(ctx->backend)) {
+            fprintf(stderr, "%s: hardware counters need the cpu backend\n", __func__);
+            return false;
+        }
+        bert_perf perf;
+        if (!bert_perf_open(&perf)) {
+            fprintf(stderr, "%s: failed to open hardware counters: %s\n", __func__, strerror(errno));
+            return false;
+        }
+        bert_perf_close(&perf);
+    }
+    ctx->profile_counters = enable;
+    return true;
+}
+
+// fold one forward into the running profile: node times when profiling, region times
+// and counters when counting
+static void bert_profile_add(bert_ctx * ctx, ggml_cgraph * gf, const std::vector<int64_t> & node_us, const std::vector<bert_profile_region> & regions) {
+    std::lock_guard<std::mutex> lock(ctx->profile_mutex);
+    bert_profile & profile = ctx->profile;
+
+    profile.n_forward++;
+    profile.stage_us.resize(ctx->stage_nodes.size());
+    profile.regions.resize(ctx->section_nodes.size());
+
+    size_t stage = 0;
+    for (size_t r = 0; r < ctx->section_nodes.size(); r++) {
+        while (ctx->section_nodes[r].first > ctx->stage_nodes[stage]) stage++;
+        profile.regions[r].stage = stage;
+        profile.regions[r].section = ctx->section_nodes[r].second;
+    }
+
+    if (!node_us.empty()) {
+        size_t region = 0;
+        for (int i = 0; i < gf->n_nodes; i++) {
+            while (i >= ctx->section_nodes[region].first) region++;
+
+            const int64_t t = node_us[i];
+            bert_profile_op & op = profile.ops[ggml_op_desc(gf->nodes[i])];
+            op.n_nodes++;
+            op.time_us += t;
+            profile.regions[region].time_us += t;
+            profile.stage_us[profile.regions[region].stage] += t;
+            profile.section_us[profile.regions[region].section] += t;
+            profile.total_us += t;
+        }
+    }
+
+    for (size_t r = 0; r < regions.size(); r++) {
+        bert_profile_region & dst = profile.regions[r];
+        for (int c = 0; c < BERT_COUNTER_COUNT; c++) {
+            dst.counters[c] += regions[r].counters[c];
+        }
+        profile.counters = true;
+
+        // without node times the region's wall time is all there is
+        if (node_us.empty()) {
+            const int64_t t = regions[r].time_us;
+            dst.time_us += t;
+            profile.stage_us[dst.stage] += t;
+            profile.section_us[dst.section] += t;
+            profile.total_us += t;
+        }
+    }
+}
+
+// run the graph a stage at a time, for a span per stage when tracing. when streaming
+// layers, only the weights of the running stage and the next one stay mapped in. with
+// perf, every section run within a stage is computed on its own between counter reads
+static void bert_compute_stages(bert_ctx * ctx, ggml_cgraph * gf, std::vector<int64_t> * node_us, const bert_perf * perf, std::vector<bert_profile_region> * regions) {
+    const bool streaming = !ctx->stage_weights.empty();
+    const bool tracing = g_trace_on.load(std::memory_order_relaxed);
+    const size_t n_stages = ctx->stage_nodes.size();
+    if (streaming && n_stages > 0) {
+        const auto & first = ctx->stage_weights[0];
+        madvise(first.first, first.second, MADV_WILLNEED);
+    }
+
+    int node_start = 0;
+    size_t region = 0;
+    for (size_t i = 0; i < n_stages; i++) {
+        if (streaming && i + 1 < n_stages) {
+            const auto & next = ctx->stage_weights[i + 1];
+            madvise(next.first, next.second, MADV_WILLNEED);
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+        if (perf) {
+            uint64_t before[BERT_COUNTER_COUNT];
+            uint64_t after[BERT_COUNTER_COUNT];
+            for (; region < ctx->section_nodes.size() && ctx->section_nodes[region].first <= ctx->stage_nodes[i]; region++) {
+                const int node_end = ctx->section_nodes[region].first;
+                const int64_t t_region_us = ggml_time_us();
+                bert_perf_read(perf, before);
+                bert_compute_nodes(ctx, gf, node_start, node_end, node_us);
+                bert_perf_read(perf, after);
+
+                bert_profile_region & r = (*regions)[region];
+                r.time_us = ggml_time_us() - t_region_us;
+                for (int c = 0; c < BERT_COUNTER_COUNT; c++) {
+                    r.counters[c] = after[c] - before[c];
+                }
+                node_start = node_end;
+            }
+        } else {
+            bert_compute_nodes(ctx, gf, node_start, ctx->stage_nodes[i], node_us);
+            node_start = ctx->stage_nodes[i];
+        }
+
+        if (tracing) {
+            ggml_backend_synchronize(ctx->backend);
+            const std::string name = i == 0 ? "embeddings" : i + 1 == n_stages ? "pooling" : "layer " + std::to_string(i - 1);
+            bert_trace_add(name, "stage", t_start_us, ggml_time_us() - t_start_us, "");
+        }
+
+        if (streaming) {
+            const auto & done = ctx->stage_weights[i];
+            madvise(done.first, done.second, MADV_DONTNEED);
+        }
+    }
+}
+
 void bert_forward_batch(bert_ctx * ctx, bert_batch batch, float * embeddings, int32_t n_threads) {
+    // only one graph can live in the compute buffer at a time
+    std::unique_lock<std::mutex> lock(ctx->compute_mutex, std::defer_lock);
+    const int64_t t_wait_us = ggml_time_us();
+    {
+        bert_trace_span span("wait_compute", "forward");
+        lock.lock();
+    }
+    const int64_t t_start_us = ggml_time_us();
+    bert_metrics_counters & metrics = ctx->metrics;
+    bert_metrics_observe(&metrics.phase_us[BERT_PHASE_WAIT], t_start_us - t_wait_us);
+
+    bert_trace_span span("forward", "forward");
+    span.arg("batch_size", batch.size());
+
     // reset alloc buffer to clean the memory from previous invocations
     ggml_allocr_reset(ctx->compute_alloc);
 
     // build the compute graph
-    ggml_cgraph * gf = bert_build_graph(ctx, batch);
+    ggml_cgraph * gf;
+    {
+        bert_trace_span span_build("build_graph", "forward");
+        gf = bert_build_graph(ctx, batch);
+    }
     if (gf == nullptr) {
         fprintf(stderr, "%s: failed to build compute graph\n", __func__);
         return;
     }
+    span.arg("nodes", gf->n_nodes);
 
     // allocate memory for the graph
-    ggml_allocr_alloc_graph(ctx->compute_alloc, gf);
+    {
+        bert_trace_span span_alloc("alloc_graph", "forward");
+        const size_t used = ggml_allocr_alloc_graph(ctx->compute_alloc, gf);
+        ctx->compute_peak = std::max(ctx->compute_peak.load(std::memory_order_relaxed), used);
+    }
+    const int64_t t_compute_us = ggml_time_us();
+    bert_metrics_observe(&metrics.phase_us[BERT_PHASE_BUILD], t_compute_us - t_start_us);
 
     // print timing information per ggml operation (for debugging purposes)
     if (verbosity >= 3) {
@@ -882,25 +1693,75 @@ void bert_forward_batch(bert_ctx * ctx, bert_batch batch, float * embeddings, in
     }
 #endif
 
-    // execute the graph
-    ggml_backend_graph_compute(ctx->backend, gf);
-
-    // the last node is the embedding tensor
-    struct ggml_tensor * output = gf->nodes[gf->n_nodes - 1];
+    // node timings are only collected while profiling or tracing nodes
+    const bool profiling = ctx->profiling;
+    const bool per_node = profiling || g_trace_nodes.load(std::memory_order_relaxed);
+    std::vector<int64_t> node_us(per_node ? gf->n_nodes : 0);
+    std::vector<int64_t> * timings = per_node ? &node_us : nullptr;
 
-    // copy the embeddings to the location passed by the user
-    ggml_backend_tensor_get(output, embeddings, 0, ggml_nbytes(output));
-}
+    // counters are opened on the thread running the forward, so its compute threads inherit them
+    bert_perf perf;
+    const bool counting = ctx->profile_counters && bert_perf_open(&perf);
+    std::vector<bert_profile_region> regions(counting ? ctx->section_nodes.size() : 0);
 
-void bert_encode_batch(struct bert_ctx * ctx, bert_strings texts, float * embeddings, int32_t n_threads) {
-    int32_t N = bert_n_max_tokens(ctx);
+    // execute the graph, a stage at a time when streaming weights from disk, tracing or counting
+    {
+        bert_trace_span span_compute("compute", "forward");
+        if (ctx->stage_weights.empty() && !g_trace_on.load(std::memory_order_relaxed) && !counting) {
+            bert_compute_nodes(ctx, gf, 0, gf->n_nodes, timings);
+        } else {
+            bert_compute_stages(ctx, gf, timings, counting ? &perf : nullptr, &regions);
+        }
+    }
+    if (counting) {
+        bert_perf_close(&perf);
+    }
+
+    const int64_t t_output_us = ggml_time_us();
+    bert_metrics_observe(&metrics.phase_us[BERT_PHASE_COMPUTE], t_output_us - t_compute_us);
+
+    if (profiling || counting) {
+        bert_profile_add(ctx, gf, node_us, regions);
+    }
+
+    // the last node is the embedding tensor
+    struct ggml_tensor * output = gf->nodes[gf->n_nodes - 1];
+
+    // copy the embeddings to the location passed by the user
+    {
+        bert_trace_span span_copy("copy_out", "forward");
+        ggml_backend_tensor_get(output, embeddings, 0, ggml_nbytes(output));
+    }
+
+    const int64_t t_end_us = ggml_time_us();
+    bert_metrics_observe(&metrics.phase_us[BERT_PHASE_OUTPUT], t_end_us - t_output_us);
+    bert_metrics_observe(&metrics.phase_us[BERT_PHASE_FORWARD], t_end_us - t_start_us);
+
+    // padded shape is batch size times the longest sequence
+    size_t n_tokens = 0;
+    size_t max_len = 0;
+    for (const auto & tokens : batch) {
+        n_tokens += tokens.size();
+        max_len = std::max(max_len, tokens.size());
+    }
+    metrics.n_forward.fetch_add(1, std::memory_order_relaxed);
+    metrics.n_sequences.fetch_add(batch.size(), std::memory_order_relaxed);
+    metrics.n_tokens.fetch_add(n_tokens, std::memory_order_relaxed);
+    metrics.n_padded_tokens.fetch_add(batch.size() * max_len, std::memory_order_relaxed);
+    bert_metrics_observe(&metrics.batch_size, batch.size());
+}
+
+void bert_encode_batch(struct bert_ctx * ctx, bert_strings texts, float * embeddings, int32_t n_threads) {
+    int32_t N = bert_n_max_tokens(ctx);
     int32_t n_input = texts.size();
 
+    const int64_t t_start_us = ggml_time_us();
     bert_batch batch;
     for (int i = 0; i < n_input; i++) {
         bert_tokens tokens = bert_tokenize(ctx, texts[i], N);
         batch.push_back(tokens);
     }
+    bert_metrics_observe_phase(ctx, BERT_PHASE_TOKENIZE, ggml_time_us() - t_start_us);
 
     bert_forward_batch(ctx, batch, embeddings, n_threads);
 }
@@ -913,6 +1774,89 @@ void bert_encode_batch_c(struct bert_ctx * ctx, const char ** texts, float * emb
     bert_encode_batch(ctx, strings, embeddings, n_threads);
 }
 
+// run in chunks no larger than the batch the compute buffer was sized for
+static void bert_forward_batch_chunked(struct bert_ctx * ctx, bert_batch & batch, float * embeddings, int32_t n_threads) {
+    const int32_t n_embd = bert_n_embd(ctx);
+    const int32_t n_input = batch.size();
+    const int32_t n_chunk = std::max(ctx->buf_batch_size, 1);
+
+    bert_batch chunk;
+    for (int32_t i = 0; i < n_input; i += n_chunk) {
+        const int32_t n = std::min(n_chunk, n_input - i);
+        chunk.assign(std::make_move_iterator(batch.begin() + i), std::make_move_iterator(batch.begin() + i + n));
+        bert_forward_batch(ctx, chunk, embeddings + (size_t) i * n_embd, n_threads);
+    }
+}
+
+void bert_encode_batch_buf_c(struct bert_ctx * ctx, const char * buf, const int64_t * offsets, int32_t n_input, float * embeddings, int32_t n_threads) {
+    const int32_t n_max_tokens = std::min(bert_n_max_tokens(ctx), ctx->buf_n_max_tokens);
+
+    // tokenizing happens outside the compute lock, so other threads can run a forward meanwhile
+    const int64_t t_start_us = ggml_time_us();
+    bert_batch batch(n_input);
+    for (int32_t i = 0; i < n_input; i++) {
+        bert_string text(buf + offsets[i], offsets[i + 1] - offsets[i]);
+        batch[i] = bert_tokenize(ctx, text, n_max_tokens);
+    }
+    bert_metrics_observe_phase(ctx, BERT_PHASE_TOKENIZE, ggml_time_us() - t_start_us);
+
+    bert_forward_batch_chunked(ctx, batch, embeddings, n_threads);
+}
+
+void bert_forward_batch_csr_c(struct bert_ctx * ctx, const int32_t * ids, const int64_t * offsets, int32_t n_input, float * embeddings, int32_t n_threads) {
+    if (n_input > 0 && !bert_tokens_valid(ctx, ids + offsets[0], offsets[n_input] - offsets[0])) {
+        return;
+    }
+
+    const int64_t n_max_tokens = std::min(bert_n_max_tokens(ctx), ctx->buf_n_max_tokens);
+
+    // over-long sequences are cut down to the buffer shape, keeping the final [SEP]
+    bert_batch batch(n_input);
+    for (int32_t i = 0; i < n_input; i++) {
+        const int64_t len = offsets[i + 1] - offsets[i];
+        if (len > n_max_tokens) {
+            batch[i].assign(ids + offsets[i], ids + offsets[i] + n_max_tokens - 1);
+            batch[i].push_back(ids[offsets[i + 1] - 1]);
+        } else {
+            batch[i].assign(ids + offsets[i], ids + offsets[i + 1]);
+        }
+    }
+
+    bert_forward_batch_chunked(ctx, batch, embeddings, n_threads);
+}
+
+void bert_encode_stream_c(struct bert_ctx * ctx, const char * buf, const int64_t * offsets, int32_t n_input, float * embeddings, int32_t n_threads) {
+    const int32_t n_embd = bert_n_embd(ctx);
+    const int32_t n_max_tokens = std::min(bert_n_max_tokens(ctx), ctx->buf_n_max_tokens);
+    const int32_t n_chunk = std::max(ctx->buf_batch_size, 1);
+
+    auto tokenize_chunk = [=](int32_t i0) {
+        const int64_t t_start_us = ggml_time_us();
+        const int32_t n = std::min(n_chunk, n_input - i0);
+        bert_batch batch(n);
+        for (int32_t i = 0; i < n; i++) {
+            bert_string text(buf + offsets[i0 + i], offsets[i0 + i + 1] - offsets[i0 + i]);
+            batch[i] = bert_tokenize(ctx, text, n_max_tokens);
+        }
+        bert_metrics_observe_phase(ctx, BERT_PHASE_TOKENIZE, ggml_time_us() - t_start_us);
+        return batch;
+    };
+
+    if (n_input <= 0) {
+        return;
+    }
+
+    // double buffered: a worker tokenizes chunk i + 1 while chunk i runs through the model
+    std::future<bert_batch> next = std::async(std::launch::async, tokenize_chunk, 0);
+    for (int32_t i = 0; i < n_input; i += n_chunk) {
+        bert_batch batch = next.get();
+        if (i + n_chunk < n_input) {
+            next = std::async(std::launch::async, tokenize_chunk, i + n_chunk);
+        }
+        bert_forward_batch(ctx, batch, embeddings + (size_t) i * n_embd, n_threads);
+    }
+}
+
 void bert_forward(struct bert_ctx * ctx, bert_tokens tokens, float * embeddings, int32_t n_threads) {
     bert_batch batch = {tokens};
     bert_forward_batch(ctx, batch, embeddings, n_threads);
@@ -922,3 +1866,889 @@ void bert_encode(struct bert_ctx * ctx, bert_string text, float * embeddings, in
     bert_strings strings = {text};
     bert_encode_batch(ctx, strings, embeddings, n_threads);
 }
+
+//
+// warmup
+//
+
+// read one byte per page so the weights are resident before the first request
+static void bert_touch_pages(const void * data, size_t size) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const volatile uint8_t * p = (const volatile uint8_t *) data;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < size; i += page) {
+        sum += p[i];
+    }
+    (void) sum;
+}
+
+bool bert_warmup(struct bert_ctx * ctx, const bert_warmup_params & params) {
+    if (!ctx->compute_alloc) {
+        fprintf(stderr, "%s: compute buffers must be allocated first\n", __func__);
+        return false;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    // weights, whether read into a buffer or mapped from the file (streaming keeps them out on purpose)
+    if (ctx->params.stream_layers) {
+        // nothing to touch
+    } else if (ctx->mmap_addr) {
+        bert_touch_pages(ctx->mmap_addr, ctx->mmap_size);
+    } else if (ctx->weights_buffer && ggml_backend_buffer_is_host(ctx->weights_buffer)) {
+        bert_touch_pages(ggml_backend_buffer_get_base(ctx->weights_buffer), ggml_backend_buffer_get_size(ctx->weights_buffer));
+    }
+
+    // fresh anonymous pages only get backed on write
+    if (ctx->compute_buffer && ggml_backend_buffer_is_host(ctx->compute_buffer)) {
+        std::lock_guard<std::mutex> lock(ctx->compute_mutex);
+        memset(ggml_backend_buffer_get_base(ctx->compute_buffer), 0, ggml_backend_buffer_get_size(ctx->compute_buffer));
+    }
+
+    // one full forward per shape bucket builds each graph once and warms the kernels
+    std::vector<int32_t> seq_lens = params.seq_lens;
+    if (seq_lens.empty()) {
+        seq_lens.push_back(ctx->buf_n_max_tokens);
+    }
+    const int32_t batch_size = params.batch_size > 0 ? std::min(params.batch_size, ctx->buf_batch_size) : ctx->buf_batch_size;
+
+    std::vector<float> embeddings((size_t) batch_size * bert_n_embd(ctx));
+    for (int32_t len : seq_lens) {
+        len = std::max(2, std::min(len, ctx->buf_n_max_tokens));
+        bert_tokens tokens(len, 100); // [UNK]
+        tokens.front() = 101;         // [CLS]
+        tokens.back() = 102;          // [SEP]
+        bert_batch batch(batch_size, tokens);
+        bert_forward_batch(ctx, batch, embeddings.data(), params.n_threads);
+    }
+
+    ctx->warm = true;
+
+    if (verbosity >= 1) {
+        fprintf(stderr, "%s: warmed up %zu shapes in %.2f ms\n", __func__, seq_lens.size(), (ggml_time_us() - t_start_us) / 1000.0);
+    }
+
+    return true;
+}
+
+//
+// latency histograms
+//
+
+static int bert_histogram_bucket(int64_t value) {
+    const int64_t n_sub = 1 << BERT_HIST_SUB_BITS;
+    if (value < n_sub) {
+        return value < 0 ? 0 : (int) value;
+    }
+
+    // exponent selects the power of two, the next bits below it select the sub-bucket
+    int e = 63 - __builtin_clzll((uint64_t) value);
+    int sub = (value >> (e - BERT_HIST_SUB_BITS)) & (n_sub - 1);
+    int bucket = (e - BERT_HIST_SUB_BITS + 1) * n_sub + sub;
+    return std::min(bucket, BERT_HIST_BUCKETS - 1);
+}
+
+int64_t bert_histogram_bucket_max(int bucket) {
+    const int64_t n_sub = 1 << BERT_HIST_SUB_BITS;
+    if (bucket < n_sub) {
+        return bucket;
+    }
+    int e = bucket / n_sub + BERT_HIST_SUB_BITS - 1;
+    int64_t sub = bucket % n_sub;
+    return ((n_sub + sub + 1) << (e - BERT_HIST_SUB_BITS)) - 1;
+}
+
+void bert_histogram_add(bert_histogram * hist, int64_t value) {
+    hist->counts[bert_histogram_bucket(value)]++;
+    hist->n++;
+    hist->sum += value;
+    hist->max = std::max(hist->max, value);
+}
+
+int64_t bert_histogram_quantile(const bert_histogram * hist, double q) {
+    if (hist->n == 0) {
+        return 0;
+    }
+
+    const uint64_t rank = std::max<uint64_t>(1, (uint64_t) std::ceil(q * hist->n));
+    uint64_t seen = 0;
+    for (int i = 0; i < BERT_HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            return std::min(bert_histogram_bucket_max(i), hist->max);
+        }
+    }
+    return hist->max;
+}
+
+//
+// metrics
+//
+
+static void bert_metrics_observe(bert_atomic_histogram * hist, int64_t value) {
+    hist->counts[bert_histogram_bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    hist->n.fetch_add(1, std::memory_order_relaxed);
+    hist->sum.fetch_add(value, std::memory_order_relaxed);
+    int64_t max = hist->max.load(std::memory_order_relaxed);
+    while (value > max && !hist->max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+}
+
+void bert_metrics_observe_phase(struct bert_ctx * ctx, bert_phase phase, int64_t us) {
+    bert_metrics_observe(&ctx->metrics.phase_us[phase], us);
+}
+
+// counts are read one by one, so n may be slightly ahead of the buckets under load
+static void bert_metrics_snapshot(const bert_atomic_histogram & hist, bert_histogram * out) {
+    for (int i = 0; i < BERT_HIST_BUCKETS; i++) {
+        out->counts[i] = hist.counts[i].load(std::memory_order_relaxed);
+    }
+    out->n = hist.n.load(std::memory_order_relaxed);
+    out->sum = hist.sum.load(std::memory_order_relaxed);
+    out->max = hist.max.load(std::memory_order_relaxed);
+}
+
+const char * bert_phase_name(bert_phase phase) {
+    switch (phase) {
+        case BERT_PHASE_TOKENIZE: return "tokenize";
+        case BERT_PHASE_QUEUE:    return "queue";
+        case BERT_PHASE_WAIT:     return "wait";
+        case BERT_PHASE_BUILD:    return "build";
+        case BERT_PHASE_COMPUTE:  return "compute";
+        case BERT_PHASE_OUTPUT:   return "output";
+        case BERT_PHASE_FORWARD:  return "forward";
+        default:                  return "unknown";
+    }
+}
+
+//
+// completion callbacks for the c api
+//
+
+struct bert_completion {
+    bert_completion_callback_c callback = NULL;
+    void * user_data = NULL;
+
+    // filled by the per-sequence callbacks of the batch in flight, handed over in one call when it ends
+    // (only ever touched from the batcher thread)
+    std::vector<uint64_t> tags;
+    std::vector<int32_t> status;
+    std::vector<float> embeddings;
+
+    // queued but not yet delivered, for bert_flush_c
+    std::mutex mutex;
+    std::condition_variable cond;
+    int64_t n_pending = 0;
+};
+
+static void bert_completion_free(bert_ctx * ctx) {
+    delete ctx->completion;
+    ctx->completion = NULL;
+}
+
+static void bert_completion_deliver(bert_completion * completion, int32_t n_embd) {
+    const int32_t n = completion->tags.size();
+    if (n == 0) {
+        return;
+    }
+
+    completion->callback(
+        completion->user_data, completion->tags.data(), completion->status.data(), completion->embeddings.data(), n, n_embd
+    );
+    completion->tags.clear();
+    completion->status.clear();
+    completion->embeddings.clear();
+
+    std::lock_guard<std::mutex> lock(completion->mutex);
+    completion->n_pending -= n;
+    completion->cond.notify_all();
+}
+
+//
+// dynamic batching
+//
+
+struct bert_batcher_request {
+    bert_tokens tokens;
+    bert_callback callback;
+    bert_request_params params;
+    int64_t t_submit_us;
+};
+
+struct bert_batcher {
+    bert_ctx * ctx;
+    bert_batcher_params params;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool stop = false;
+
+    // one lane per priority class
+    std::deque<bert_batcher_request> queue[BERT_PRIORITY_COUNT];
+    int64_t n_queued_tokens[BERT_PRIORITY_COUNT] = {};
+    bert_histogram latency[BERT_PRIORITY_COUNT];
+
+    // running estimate of compute cost, drives admission control
+    double us_per_token = 0.0;
+
+    std::thread worker;
+};
+
+static void bert_batcher_loop(bert_batcher * batcher) {
+    bert_ctx * ctx = batcher->ctx;
+    const bert_batcher_params & params = batcher->params;
+
+    // a batch can never be larger than the shape the compute buffer was measured for
+    const int32_t n_embd = bert_n_embd(ctx);
+    const int32_t max_batch_size = ctx->buf_batch_size;
+    const int64_t buf_batch_tokens = (int64_t) ctx->buf_batch_size * ctx->buf_n_max_tokens;
+    const int64_t max_batch_tokens[BERT_PRIORITY_COUNT] = {
+        std::min<int64_t>(params.interactive_max_batch_tokens, buf_batch_tokens),
+        std::min<int64_t>(params.max_batch_tokens, buf_batch_tokens),
+    };
+    const int64_t max_delay_us[BERT_PRIORITY_COUNT] = {
+        params.interactive_max_delay_us,
+        params.max_delay_us,
+    };
+
+    bert_trace_thread_name("batcher");
+
+    auto & queue = batcher->queue;
+    std::vector<bert_batcher_request> requests;
+    std::vector<bert_batcher_request> dropped;
+    std::vector<bert_status> dropped_status;
+    std::vector<float> embeddings;
+    bert_batch batch;
+
+    while (true) {
+        int32_t cur_max_len = 0;
+        {
+            std::unique_lock<std::mutex> lock(batcher->mutex);
+
+            // sleep until there is work, exit once stopped and drained
+            auto pending = [&] { return !queue[BERT_PRIORITY_INTERACTIVE].empty() || !queue[BERT_PRIORITY_BULK].empty(); };
+            batcher->cond.wait(lock, [&] { return batcher->stop || pending(); });
+            if (!pending()) {
+                break;
+            }
+
+            // let more requests join until the batch is full or the oldest one has waited long enough,
+            // re-evaluated on every arrival so an interactive request cuts a bulk wait short
+            int lead;
+            while (true) {
+                lead = queue[BERT_PRIORITY_INTERACTIVE].empty() ? BERT_PRIORITY_BULK : BERT_PRIORITY_INTERACTIVE;
+                const bool full = (
+                    (int32_t) queue[lead].size() >= max_batch_size ||
+                    batcher->n_queued_tokens[lead] >= max_batch_tokens[lead]
+                );
+                const int64_t t_flush_us = queue[lead].front().t_submit_us + max_delay_us[lead];
+                const int64_t t_now_us = ggml_time_us();
+                if (batcher->stop || full || t_now_us >= t_flush_us) {
+                    break;
+                }
+                batcher->cond.wait_for(lock, std::chrono::microseconds(t_flush_us - t_now_us));
+            }
+
+            // take the lead lane in arrival order, then top up with bulk work while the padded batch still fits,
+            // requests nobody is waiting for anymore are dropped here so they never reach the graph
+            requests.clear();
+            dropped.clear();
+            dropped_status.clear();
+            const int64_t t_now_us = ggml_time_us();
+            cur_max_len = 0;
+            for (int p = lead; p < BERT_PRIORITY_COUNT; p++) {
+                while (!queue[p].empty() && (int32_t) requests.size() < max_batch_size) {
+                    const bert_batcher_request & next = queue[p].front();
+                    const bool cancelled = next.params.cancel && next.params.cancel->cancelled.load(std::memory_order_relaxed);
+                    const bool expired = next.params.deadline_us > 0 && t_now_us >= next.params.deadline_us;
+                    if (cancelled || expired) {
+                        batcher->n_queued_tokens[p] -= next.tokens.size();
+                        dropped_status.push_back(cancelled ? BERT_STATUS_CANCELLED : BERT_STATUS_EXPIRED);
+                        dropped.push_back(std::move(queue[p].front()));
+                        queue[p].pop_front();
+                        continue;
+                    }
+
+                    const int32_t new_max_len = std::max(cur_max_len, (int32_t) next.tokens.size());
+                    if (!requests.empty() && (int64_t) (requests.size() + 1) * new_max_len > max_batch_tokens[lead]) {
+                        break;
+                    }
+                    cur_max_len = new_max_len;
+                    batcher->n_queued_tokens[p] -= next.tokens.size();
+                    requests.push_back(std::move(queue[p].front()));
+                    queue[p].pop_front();
+                }
+            }
+        }
+
+        for (size_t i = 0; i < dropped.size(); i++) {
+            auto & counter = dropped_status[i] == BERT_STATUS_CANCELLED ? ctx->metrics.n_cancelled : ctx->metrics.n_expired;
+            counter.fetch_add(1, std::memory_order_relaxed);
+            dropped[i].callback(dropped_status[i], nullptr, 0);
+        }
+        if (requests.empty()) {
+            if (ctx->completion) {
+                bert_completion_deliver(ctx->completion, n_embd);
+            }
+            continue;
+        }
+
+        // run the batch outside of the lock so submitters are never blocked on compute
+        bert_trace_span span("batch", "batcher");
+        const int32_t n_batch_size = requests.size();
+        batch.resize(n_batch_size);
+        for (int32_t i = 0; i < n_batch_size; i++) {
+            batch[i] = std::move(requests[i].tokens);
+        }
+        embeddings.resize((size_t) n_batch_size * n_embd);
+        const int64_t t_start_us = ggml_time_us();
+        for (const auto & request : requests) {
+            bert_metrics_observe(&ctx->metrics.phase_us[BERT_PHASE_QUEUE], t_start_us - request.t_submit_us);
+        }
+        span.arg("sequences", n_batch_size);
+        span.arg("padded_tokens", (int64_t) n_batch_size * cur_max_len);
+        if (span.t_start_us >= 0) {
+            int64_t t_oldest_us = t_start_us;
+            for (const auto & request : requests) {
+                t_oldest_us = std::min(t_oldest_us, request.t_submit_us);
+            }
+            span.arg("oldest_wait_us", t_start_us - t_oldest_us);
+        }
+        bert_forward_batch(ctx, batch, embeddings.data(), params.n_threads);
+        const int64_t t_forward_us = ggml_time_us() - t_start_us;
+
+        for (int32_t i = 0; i < n_batch_size; i++) {
+            requests[i].callback(BERT_STATUS_OK, embeddings.data() + (size_t) i * n_embd, n_embd);
+        }
+
+        // c api consumers get the whole micro-batch in one call
+        if (ctx->completion) {
+            bert_completion_deliver(ctx->completion, n_embd);
+        }
+
+        const int64_t t_done_us = ggml_time_us();
+        std::lock_guard<std::mutex> lock(batcher->mutex);
+        for (int32_t i = 0; i < n_batch_size; i++) {
+            bert_histogram_add(&batcher->latency[requests[i].params.priority], t_done_us - requests[i].t_submit_us);
+        }
+
+        // exponential moving average of the cost of one padded token
+        const double us_per_token = (double) t_forward_us / ((int64_t) n_batch_size * cur_max_len);
+        batcher->us_per_token = batcher->us_per_token == 0.0 ? us_per_token : 0.8 * batcher->us_per_token + 0.2 * us_per_token;
+    }
+}
+
+bool bert_batcher_start(struct bert_ctx * ctx, bert_batcher_params params) {
+    if (ctx->batcher) {
+        fprintf(stderr, "%s: batcher already running\n", __func__);
+        return false;
+    }
+    if (!ctx->compute_alloc) {
+        fprintf(stderr, "%s: compute buffers must be allocated first\n", __func__);
+        return false;
+    }
+
+    bert_batcher * batcher = new bert_batcher;
+    batcher->ctx = ctx;
+    batcher->params = params;
+    batcher->worker = std::thread(bert_batcher_loop, batcher);
+    ctx->batcher = batcher;
+
+    return true;
+}
+
+void bert_batcher_stop(struct bert_ctx * ctx) {
+    bert_batcher * batcher = ctx->batcher;
+    if (!batcher) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(batcher->mutex);
+        batcher->stop = true;
+    }
+    batcher->cond.notify_all();
+    batcher->worker.join();
+
+    ctx->batcher = NULL;
+    delete batcher;
+}
+
+bert_status bert_batcher_submit(struct bert_ctx * ctx, bert_tokens tokens, bert_callback callback, const bert_request_params & params) {
+    bert_batcher * batcher = ctx->batcher;
+    if (!batcher) {
+        fprintf(stderr, "%s: batcher not started\n", __func__);
+        return BERT_STATUS_INVALID;
+    }
+
+    const bert_priority priority = params.priority;
+    if (priority < 0 || priority >= BERT_PRIORITY_COUNT) {
+        fprintf(stderr, "%s: invalid priority %d\n", __func__, priority);
+        return BERT_STATUS_INVALID;
+    }
+
+    const int32_t n_tokens = tokens.size();
+    if (n_tokens == 0 || n_tokens > ctx->buf_n_max_tokens) {
+        fprintf(stderr, "%s: invalid sequence length %d (maximum is %d)\n", __func__, n_tokens, ctx->buf_n_max_tokens);
+        return BERT_STATUS_INVALID;
+    }
+    if (!bert_tokens_valid(ctx, tokens.data(), n_tokens)) {
+        return BERT_STATUS_INVALID;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(batcher->mutex);
+        if (batcher->stop) {
+            return BERT_STATUS_INVALID;
+        }
+
+        // everything at this priority or above runs first, so that is the work we would wait behind
+        const int64_t max_queue_delay_us = batcher->params.max_queue_delay_us;
+        if (max_queue_delay_us > 0) {
+            int64_t n_ahead = n_tokens;
+            for (int p = 0; p <= priority; p++) {
+                n_ahead += batcher->n_queued_tokens[p];
+            }
+            if (n_ahead * batcher->us_per_token > max_queue_delay_us) {
+                ctx->metrics.n_rejected.fetch_add(1, std::memory_order_relaxed);
+                return BERT_STATUS_REJECTED;
+            }
+        }
+
+        ctx->metrics.n_requests.fetch_add(1, std::memory_order_relaxed);
+        batcher->queue[priority].push_back({std::move(tokens), std::move(callback), params, ggml_time_us()});
+        batcher->n_queued_tokens[priority] += n_tokens;
+    }
+    batcher->cond.notify_one();
+
+    return BERT_STATUS_OK;
+}
+
+void bert_get_metrics(struct bert_ctx * ctx, bert_metrics * metrics) {
+    const bert_metrics_counters & counters = ctx->metrics;
+    metrics->n_requests = counters.n_requests.load(std::memory_order_relaxed);
+    metrics->n_rejected = counters.n_rejected.load(std::memory_order_relaxed);
+    metrics->n_expired = counters.n_expired.load(std::memory_order_relaxed);
+    metrics->n_cancelled = counters.n_cancelled.load(std::memory_order_relaxed);
+    metrics->n_forward = counters.n_forward.load(std::memory_order_relaxed);
+    metrics->n_sequences = counters.n_sequences.load(std::memory_order_relaxed);
+    metrics->n_tokens = counters.n_tokens.load(std::memory_order_relaxed);
+    metrics->n_padded_tokens = counters.n_padded_tokens.load(std::memory_order_relaxed);
+    bert_metrics_snapshot(counters.batch_size, &metrics->batch_size);
+    for (int i = 0; i < BERT_PHASE_COUNT; i++) {
+        bert_metrics_snapshot(counters.phase_us[i], &metrics->phase_us[i]);
+    }
+
+    metrics->n_queued = 0;
+    if (bert_batcher * batcher = ctx->batcher) {
+        std::lock_guard<std::mutex> lock(batcher->mutex);
+        for (int p = 0; p < BERT_PRIORITY_COUNT; p++) {
+            metrics->n_queued += batcher->queue[p].size();
+        }
+    }
+
+    metrics->weights_bytes = ctx->mmap_addr ? ctx->mmap_size : ctx->weights_buffer ? ggml_backend_buffer_get_size(ctx->weights_buffer) : 0;
+    metrics->compute_bytes = ctx->compute_buffer ? ggml_backend_buffer_get_size(ctx->compute_buffer) : 0;
+    metrics->locked_bytes = bert_locked_bytes(ctx);
+}
+
+void bert_batcher_latency(struct bert_ctx * ctx, bert_priority priority, bert_histogram * hist) {
+    bert_batcher * batcher = ctx->batcher;
+    if (!batcher || priority < 0 || priority >= BERT_PRIORITY_COUNT) {
+        *hist = bert_histogram();
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(batcher->mutex);
+    *hist = batcher->latency[priority];
+}
+
+//
+// async api
+//
+
+// the batcher is the library's executor, start one on first use
+static bool bert_batcher_ensure(struct bert_ctx * ctx) {
+    static std::mutex start_mutex;
+    std::lock_guard<std::mutex> lock(start_mutex);
+    if (ctx->batcher) {
+        return true;
+    }
+    return bert_batcher_start(ctx, bert_batcher_params());
+}
+
+std::future<bert_result> bert_forward_async(struct bert_ctx * ctx, bert_tokens tokens, const bert_request_params & params) {
+    auto promise = std::make_shared<std::promise<bert_result>>();
+    std::future<bert_result> future = promise->get_future();
+
+    bert_status status = BERT_STATUS_INVALID;
+    if (bert_batcher_ensure(ctx)) {
+        status = bert_batcher_submit(ctx, std::move(tokens), [promise](bert_status status, const float * embedding, int32_t n_embd) {
+            bert_result result;
+            result.status = status;
+            if (status == BERT_STATUS_OK) {
+                result.embedding.assign(embedding, embedding + n_embd);
+            }
+            promise->set_value(std::move(result));
+        }, params);
+    }
+
+    // the callback will never run, resolve right away
+    if (status != BERT_STATUS_OK) {
+        bert_result result;
+        result.status = status;
+        promise->set_value(std::move(result));
+    }
+
+    return future;
+}
+
+std::future<bert_result> bert_encode_async(struct bert_ctx * ctx, bert_string text, const bert_request_params & params) {
+    const int32_t n_max_tokens = std::min(bert_n_max_tokens(ctx), ctx->buf_n_max_tokens);
+    const int64_t t_start_us = ggml_time_us();
+    bert_tokens tokens = bert_tokenize(ctx, text, n_max_tokens);
+    bert_metrics_observe_phase(ctx, BERT_PHASE_TOKENIZE, ggml_time_us() - t_start_us);
+    return bert_forward_async(ctx, std::move(tokens), params);
+}
+
+bert_encode_awaitable bert_encode_co(struct bert_ctx * ctx, bert_string text, const bert_request_params & params) {
+    const int32_t n_max_tokens = std::min(bert_n_max_tokens(ctx), ctx->buf_n_max_tokens);
+    const int64_t t_start_us = ggml_time_us();
+    bert_tokens tokens = bert_tokenize(ctx, text, n_max_tokens);
+    bert_metrics_observe_phase(ctx, BERT_PHASE_TOKENIZE, ggml_time_us() - t_start_us);
+    return {ctx, std::move(tokens), params, {}};
+}
+
+bool bert_encode_awaitable::await_suspend(std::coroutine_handle<> handle) {
+    if (!bert_batcher_ensure(ctx)) {
+        result.status = BERT_STATUS_INVALID;
+        return false;
+    }
+
+    // once submitted the coroutine may resume (and this object go away) at any moment
+    bert_encode_awaitable * self = this;
+    bert_status status = bert_batcher_submit(ctx, std::move(tokens), [self, handle](bert_status status, const float * embedding, int32_t n_embd) {
+        self->result.status = status;
+        if (status == BERT_STATUS_OK) {
+            self->result.embedding.assign(embedding, embedding + n_embd);
+        }
+        handle.resume();
+    }, params);
+
+    if (status != BERT_STATUS_OK) {
+        result.status = status;
+        return false;
+    }
+    return true;
+}
+
+//
+// c submission api
+//
+
+void bert_set_completion_callback_c(struct bert_ctx * ctx, bert_completion_callback_c callback, void * user_data) {
+    if (!ctx->completion) {
+        ctx->completion = new bert_completion;
+    }
+    ctx->completion->callback = callback;
+    ctx->completion->user_data = user_data;
+}
+
+static bool bert_submit_one_c(struct bert_ctx * ctx, bert_tokens tokens, uint64_t tag, int32_t priority) {
+    bert_completion * completion = ctx->completion;
+    {
+        std::lock_guard<std::mutex> lock(completion->mutex);
+        completion->n_pending++;
+    }
+
+    // stage the result, bert_completion_deliver hands it over at the end of the batch
+    bert_request_params params;
+    params.priority = (bert_priority) priority;
+    bert_status status = bert_batcher_submit(ctx, std::move(tokens), [completion, tag](bert_status status, const float * embedding, int32_t n_embd) {
+        completion->tags.push_back(tag);
+        completion->status.push_back(status);
+        if (status == BERT_STATUS_OK) {
+            completion->embeddings.insert(completion->embeddings.end(), embedding, embedding + n_embd);
+        } else {
+            completion->embeddings.resize(completion->embeddings.size() + n_embd, 0.0f);
+        }
+    }, params);
+
+    if (status != BERT_STATUS_OK) {
+        std::lock_guard<std::mutex> lock(completion->mutex);
+        completion->n_pending--;
+        return false;
+    }
+    return true;
+}
+
+int32_t bert_submit_c(struct bert_ctx * ctx, const char ** texts, const uint64_t * tags, int32_t n_input, int32_t priority) {
+    if (!ctx->completion || !ctx->completion->callback) {
+        fprintf(stderr, "%s: no completion callback registered\n", __func__);
+        return 0;
+    }
+    if (!bert_batcher_ensure(ctx)) {
+        return 0;
+    }
+
+    // one tokenize observation per call, summed over the inputs that were tokenized
+    const int32_t n_max_tokens = std::min(bert_n_max_tokens(ctx), ctx->buf_n_max_tokens);
+    int64_t t_tokenize_us = 0;
+    int32_t i = 0;
+    for (; i < n_input; i++) {
+        const int64_t t_start_us = ggml_time_us();
+        bert_tokens tokens = bert_tokenize(ctx, texts[i], n_max_tokens);
+        t_tokenize_us += ggml_time_us() - t_start_us;
+        if (!bert_submit_one_c(ctx, std::move(tokens), tags[i], priority)) {
+            break;
+        }
+    }
+    bert_metrics_observe_phase(ctx, BERT_PHASE_TOKENIZE, t_tokenize_us);
+    return i;
+}
+
+int32_t bert_submit_tokens_c(struct bert_ctx * ctx, const int32_t * ids, const int64_t * offsets, const uint64_t * tags, int32_t n_input, int32_t priority) {
+    if (!ctx->completion || !ctx->completion->callback) {
+        fprintf(stderr, "%s: no completion callback registered\n", __func__);
+        return 0;
+    }
+    if (!bert_batcher_ensure(ctx)) {
+        return 0;
+    }
+
+    for (int32_t i = 0; i < n_input; i++) {
+        bert_tokens tokens(ids + offsets[i], ids + offsets[i + 1]);
+        if (!bert_submit_one_c(ctx, std::move(tokens), tags[i], priority)) {
+            return i;
+        }
+    }
+    return n_input;
+}
+
+void bert_flush_c(struct bert_ctx * ctx) {
+    bert_completion * completion = ctx->completion;
+    if (!completion) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(completion->mutex);
+    completion->cond.wait(lock, [&] { return completion->n_pending == 0; });
+}
+
+//
+// model registry
+//
+
+struct bert_registry_entry {
+    std::string fname;
+    std::shared_ptr<bert_ctx> ctx;
+    int64_t bytes = 0;
+    uint64_t last_used = 0;
+
+    // serializes loading of this entry without blocking lookups of others
+    std::mutex load_mutex;
+};
+
+struct bert_registry {
+    bert_registry_params params;
+
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<bert_registry_entry>> entries;
+    uint64_t clock = 0;
+    bert_registry_stats stats;
+};
+
+static int64_t bert_ctx_buffer_bytes(bert_ctx * ctx) {
+    int64_t bytes = 0;
+    if (ctx->mmap_addr) {
+        bytes += ctx->mmap_size;
+    } else if (ctx->weights_buffer) {
+        bytes += ggml_backend_buffer_get_size(ctx->weights_buffer);
+    }
+    if (ctx->compute_buffer) {
+        bytes += ggml_backend_buffer_get_size(ctx->compute_buffer);
+    }
+    return bytes;
+}
+
+// drop least recently used models until the budget holds, never touching keep
+// (registry mutex held). the caller releases evicted after unlocking, since freeing
+// the last reference drains a batcher and unmaps weights
+static void bert_registry_evict(bert_registry * registry, bert_registry_entry * keep, std::vector<std::shared_ptr<bert_ctx>> & evicted) {
+    const int64_t budget = registry->params.memory_budget;
+    while (budget > 0 && registry->stats.bytes_resident > budget) {
+        bert_registry_entry * victim = nullptr;
+        for (auto & it : registry->entries) {
+            bert_registry_entry * entry = it.second.get();
+            if (entry != keep && entry->ctx && (!victim || entry->last_used < victim->last_used)) {
+                victim = entry;
+            }
+        }
+        if (!victim) {
+            break;
+        }
+
+        // in-flight users keep their reference, the model goes away with the last of them
+        evicted.push_back(std::move(victim->ctx));
+        registry->stats.bytes_resident -= victim->bytes;
+        registry->stats.n_resident--;
+        registry->stats.n_evictions++;
+        victim->bytes = 0;
+    }
+}
+
+// load a model ready to serve: compute buffers allocated, optionally warm, and batcher running
+static std::shared_ptr<bert_ctx> bert_registry_load(bert_registry * registry, const std::string & fname) {
+    const bert_registry_params & params = registry->params;
+    bert_trace_span span("load_model", "registry");
+    bert_ctx * ctx = bert_load_from_file_ext(fname.c_str(), params.load);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    const int32_t n_max_tokens = params.n_max_tokens > 0 ? std::min(params.n_max_tokens, bert_n_max_tokens(ctx)) : bert_n_max_tokens(ctx);
+    bert_allocate_buffers(ctx, n_max_tokens, params.batch_size);
+    if (params.warmup && !bert_warmup(ctx, params.warmup_params)) {
+        bert_free(ctx);
+        return nullptr;
+    }
+    if (params.start_batcher && !bert_batcher_start(ctx, params.batcher)) {
+        bert_free(ctx);
+        return nullptr;
+    }
+
+    return std::shared_ptr<bert_ctx>(ctx, bert_free);
+}
+
+// make a freshly loaded model the entry's current one (registry mutex held)
+static void bert_registry_install(bert_registry * registry, bert_registry_entry * entry, std::shared_ptr<bert_ctx> ctx, int64_t t_start_us,
+        std::vector<std::shared_ptr<bert_ctx>> & evicted) {
+    entry->bytes = bert_ctx_buffer_bytes(ctx.get());
+    entry->ctx = std::move(ctx);
+    entry->last_used = ++registry->clock;
+    registry->stats.n_loads++;
+    registry->stats.n_resident++;
+    registry->stats.bytes_resident += entry->bytes;
+    bert_histogram_add(&registry->stats.load_us, ggml_time_us() - t_start_us);
+
+    bert_registry_evict(registry, entry, evicted);
+}
+
+struct bert_registry * bert_registry_new(bert_registry_params params) {
+    bert_registry * registry = new bert_registry;
+    registry->params = params;
+    return registry;
+}
+
+void bert_registry_free(struct bert_registry * registry) {
+    delete registry;
+}
+
+void bert_registry_add(struct bert_registry * registry, const std::string & name, const std::string & fname) {
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    auto & entry = registry->entries[name];
+    if (!entry) {
+        entry.reset(new bert_registry_entry);
+        registry->stats.n_models++;
+    }
+    entry->fname = fname;
+}
+
+std::shared_ptr<bert_ctx> bert_registry_get(struct bert_registry * registry, const std::string & name) {
+    bert_registry_entry * entry;
+    {
+        std::lock_guard<std::mutex> lock(registry->mutex);
+        auto it = registry->entries.find(name);
+        if (it == registry->entries.end()) {
+            return nullptr;
+        }
+        entry = it->second.get();
+        entry->last_used = ++registry->clock;
+        if (entry->ctx) {
+            registry->stats.n_hits++;
+            return entry->ctx;
+        }
+    }
+
+    // load outside the registry lock, concurrent lookups of the same name wait here
+    std::lock_guard<std::mutex> load_lock(entry->load_mutex);
+    std::string fname;
+    {
+        std::lock_guard<std::mutex> lock(registry->mutex);
+        if (entry->ctx) {
+            registry->stats.n_hits++;
+            return entry->ctx;
+        }
+        fname = entry->fname;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+    std::shared_ptr<bert_ctx> ctx = bert_registry_load(registry, fname);
+
+    // declared before the lock so evicted models are freed after it is released
+    std::vector<std::shared_ptr<bert_ctx>> evicted;
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to load model '%s' from %s\n", __func__, name.c_str(), fname.c_str());
+        registry->stats.n_load_failures++;
+        return nullptr;
+    }
+
+    bert_registry_install(registry, entry, ctx, t_start_us, evicted);
+    return ctx;
+}
+
+std::shared_ptr<bert_ctx> bert_registry_peek(struct bert_registry * registry, const std::string & name) {
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    auto it = registry->entries.find(name);
+    if (it == registry->entries.end()) {
+        return nullptr;
+    }
+    return it->second->ctx;
+}
+
+bool bert_registry_reload(struct bert_registry * registry, const std::string & name, const std::string & fname) {
+    bert_registry_entry * entry;
+    {
+        std::lock_guard<std::mutex> lock(registry->mutex);
+        auto & slot = registry->entries[name];
+        if (!slot) {
+            slot.reset(new bert_registry_entry);
+            slot->fname = fname;
+            registry->stats.n_models++;
+        }
+        entry = slot.get();
+    }
+
+    // lookups keep being served by the current model while the new one loads
+    std::lock_guard<std::mutex> load_lock(entry->load_mutex);
+    const int64_t t_start_us = ggml_time_us();
+    std::shared_ptr<bert_ctx> ctx = bert_registry_load(registry, fname);
+
+    // the old model is released outside the lock, once in-flight requests let go of it
+    std::shared_ptr<bert_ctx> old;
+    std::vector<std::shared_ptr<bert_ctx>> evicted;
+    {
+        std::lock_guard<std::mutex> lock(registry->mutex);
+        if (!ctx) {
+            fprintf(stderr, "%s: failed to load model '%s' from %s, keeping the current one\n", __func__, name.c_str(), fname.c_str());
+            registry->stats.n_load_failures++;
+            return false;
+        }
+
+        old = std::move(entry->ctx);
+        if (old) {
+            registry->stats.bytes_resident -= entry->bytes;
+            registry->stats.n_resident--;
+            registry->stats.n_swaps++;
+        }
+        entry->fname = fname;
+        bert_registry_install(registry, entry, ctx, t_start_us, evicted);
+    }
+
+    return true;
+}
+
+void bert_registry_get_stats(struct bert_registry * registry, bert_registry_stats * stats) {
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    *stats = registry->stats;
+}
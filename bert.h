@@ -9,9 +9,16 @@
 #include <stdbool.h>
 #include <string>
 #include <vector>
+#include <atomic>
 #include <cmath>
+#include <coroutine>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
 
 #define BERT_API __attribute__ ((visibility ("default")))
 
@@ -29,6 +36,17 @@ typedef std::vector<bert_tokens> bert_batch;
 typedef std::string bert_string;
 typedef std::vector<bert_string> bert_strings;
 
+enum bert_status {
+    BERT_STATUS_OK = 0,
+    BERT_STATUS_INVALID,   // bad input or the batcher is not running
+    BERT_STATUS_REJECTED,  // admission control: estimated queueing delay too high
+    BERT_STATUS_EXPIRED,   // deadline passed before the request reached a batch
+    BERT_STATUS_CANCELLED, // cancelled before the request reached a batch
+};
+
+// called once per sequence from the batcher thread, embedding is NULL unless status is BERT_STATUS_OK
+typedef std::function<void(bert_status status, const float * embedding, int32_t n_embd)> bert_callback;
+
 //
 // data structures
 //
@@ -94,6 +112,259 @@ struct bert_model {
     std::vector<bert_layer> layers;
 };
 
+struct bert_load_params {
+    bool use_cpu = false;
+    bool use_mmap = false; // map weights read-only from the file (cpu backend only), pages are shared across processes
+    bool use_mlock = false;     // pin the weights in ram, as far as RLIMIT_MEMLOCK allows (host buffers only)
+    bool mlock_compute = false; // also pin the compute buffer once allocated
+    bool stream_layers = false; // low memory: implies use_mmap, keeps only the weights of the stage being computed (and the next) resident
+    int32_t n_layer = 0;        // run only the first n_layer encoder layers, the rest are not loaded (0 = all)
+};
+
+struct bert_batcher;
+struct bert_completion;
+
+// receives every finished sequence of one micro-batch at once, in whatever order the batcher chose;
+// status[i] is a bert_status and embeddings holds n * n_embd floats (zeros where status[i] != 0)
+typedef void (*bert_completion_callback_c)(
+    void * user_data,
+    const uint64_t * tags,
+    const int32_t * status,
+    const float * embeddings,
+    int32_t n,
+    int32_t n_embd
+);
+
+enum bert_priority {
+    BERT_PRIORITY_INTERACTIVE = 0, // latency sensitive, served first at every batch boundary
+    BERT_PRIORITY_BULK = 1,        // throughput oriented, fills whatever capacity is left
+    BERT_PRIORITY_COUNT,
+};
+
+struct bert_batcher_params {
+    int32_t n_threads = 4;
+    int32_t max_batch_tokens = 4096; // padded tokens (sequences * longest sequence) per forward
+    int64_t max_delay_us = 2000;     // how long the oldest request may wait for others to join
+
+    // smaller, quicker batches whenever interactive requests are waiting
+    int32_t interactive_max_batch_tokens = 512;
+    int64_t interactive_max_delay_us = 0;
+
+    // reject new work once the estimated queueing delay exceeds this (0 = never)
+    int64_t max_queue_delay_us = 0;
+};
+
+// shared between the submitter and the batcher, set it to drop a request that has not run yet
+struct bert_cancel_token {
+    std::atomic<bool> cancelled{false};
+};
+
+struct bert_request_params {
+    bert_priority priority = BERT_PRIORITY_INTERACTIVE;
+    int64_t deadline_us = 0; // absolute ggml_time_us(), 0 = none
+    std::shared_ptr<bert_cancel_token> cancel;
+};
+
+struct bert_result {
+    bert_status status = BERT_STATUS_OK;
+    std::vector<float> embedding;
+};
+
+// co_await bert_encode_co(...) suspends until the embedding is ready, the coroutine
+// is resumed on the batcher thread so hand anything heavy off to your own executor
+struct bert_encode_awaitable {
+    struct bert_ctx * ctx;
+    bert_tokens tokens;
+    bert_request_params params;
+    bert_result result;
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    bert_result await_resume() { return std::move(result); }
+};
+
+// log-linear latency histogram in microseconds, 8 sub-buckets per power of two
+#define BERT_HIST_SUB_BITS 3
+#define BERT_HIST_BUCKETS 256
+
+struct bert_histogram {
+    uint64_t counts[BERT_HIST_BUCKETS] = {};
+    uint64_t n = 0;
+    int64_t sum = 0;
+    int64_t max = 0;
+};
+
+// same buckets as bert_histogram, for counters many threads add to without a lock
+struct bert_atomic_histogram {
+    std::atomic<uint64_t> counts[BERT_HIST_BUCKETS];
+    std::atomic<uint64_t> n{0};
+    std::atomic<int64_t> sum{0};
+    std::atomic<int64_t> max{0};
+};
+
+// where the time of a sequence goes, each timed separately
+enum bert_phase {
+    BERT_PHASE_TOKENIZE = 0, // tokenizing one request or batch, timed by the caller
+    BERT_PHASE_QUEUE,        // batcher submit until its batch starts
+    BERT_PHASE_WAIT,         // forward waiting for the compute buffer
+    BERT_PHASE_BUILD,        // graph build and allocation
+    BERT_PHASE_COMPUTE,
+    BERT_PHASE_OUTPUT,       // copying embeddings out
+    BERT_PHASE_FORWARD,      // the whole forward, wait excluded
+    BERT_PHASE_COUNT,
+};
+
+// live counters on the context, updated with relaxed atomics
+struct bert_metrics_counters {
+    std::atomic<uint64_t> n_requests{0};  // sequences accepted by the batcher
+    std::atomic<uint64_t> n_rejected{0};  // refused by admission control
+    std::atomic<uint64_t> n_expired{0};
+    std::atomic<uint64_t> n_cancelled{0};
+    std::atomic<uint64_t> n_forward{0};
+    std::atomic<uint64_t> n_sequences{0}; // computed, from any entry point
+    std::atomic<uint64_t> n_tokens{0};
+    std::atomic<uint64_t> n_padded_tokens{0};
+    bert_atomic_histogram batch_size;     // sequences per forward
+    bert_atomic_histogram phase_us[BERT_PHASE_COUNT];
+};
+
+// point in time copy of the counters plus gauges, from bert_get_metrics
+struct bert_metrics {
+    uint64_t n_requests = 0;
+    uint64_t n_rejected = 0;
+    uint64_t n_expired = 0;
+    uint64_t n_cancelled = 0;
+    uint64_t n_forward = 0;
+    uint64_t n_sequences = 0;
+    uint64_t n_tokens = 0;        // real tokens, real / padded is the batching efficiency
+    uint64_t n_padded_tokens = 0;
+    bert_histogram batch_size;
+    bert_histogram phase_us[BERT_PHASE_COUNT];
+
+    int64_t n_queued = 0;         // sequences waiting in the batcher
+    int64_t weights_bytes = 0;
+    int64_t compute_bytes = 0;
+    int64_t locked_bytes = 0;
+};
+
+// where a context's memory goes, from bert_get_memory. host structures are estimates
+// from their sizes and capacities, buffers are exact
+struct bert_memory {
+    int64_t weights_bytes = 0;
+    std::map<std::string, int64_t> weights_by_type; // keyed by ggml type name (f32, f16, q4_0, ...)
+    bool weights_mapped = false;   // weights are file pages shared with other processes
+    int64_t tensor_meta_bytes = 0; // ggml context holding the weight tensor headers
+    int64_t vocab_bytes = 0;       // token strings and the lookup maps of the tokenizer
+
+    int64_t compute_bytes = 0;      // compute buffer, measured for the worst case shape
+    int64_t compute_peak_bytes = 0; // most of it any graph has used so far
+    int32_t compute_n_max_tokens = 0;
+    int32_t compute_batch_size = 0;
+    int64_t graph_meta_bytes = 0;   // scratch for graph and tensor headers of each forward
+
+    // host buffers that scale with the batch shape: input staging of each forward, plus the
+    // batcher's output buffer and the c completion buffers when those are in use
+    int64_t staging_bytes = 0;
+
+    int64_t locked_bytes = 0;
+    int64_t total_bytes = 0;        // everything above, counting each byte once
+};
+
+struct bert_warmup_params {
+    std::vector<int32_t> seq_lens; // shape buckets to run once, empty = just the longest the buffers allow
+    int32_t batch_size = 0;        // 0 = the batch size the buffers were allocated for
+    int32_t n_threads = 4;
+};
+
+// what part of the encoder a graph node belongs to, for profiling
+enum bert_section {
+    BERT_SECTION_EMBEDDINGS = 0, // lookups and sums, the embedding layer norm counts as norm
+    BERT_SECTION_ATTENTION,      // qkv projections, attention, output projection and residual
+    BERT_SECTION_FFN,            // intermediate and output projections and residual
+    BERT_SECTION_NORM,           // every layer norm
+    BERT_SECTION_POOLING,        // mean pooling and l2 normalization
+    BERT_SECTION_COUNT,
+};
+
+struct bert_profile_op {
+    uint64_t n_nodes = 0; // nodes of this op executed
+    int64_t time_us = 0;
+};
+
+// hardware counters read around every region, linux perf events
+enum bert_counter {
+    BERT_COUNTER_CYCLES = 0,
+    BERT_COUNTER_INSTRUCTIONS,
+    BERT_COUNTER_LLC_REFERENCES,
+    BERT_COUNTER_LLC_MISSES,
+    BERT_COUNTER_COUNT,
+};
+
+// one contiguous run of a section in the graph, e.g. the attention of layer 3
+struct bert_profile_region {
+    int32_t stage = 0;  // index into stage_us: 0 is the embeddings, layer i is i + 1, the last one pooling
+    bert_section section = BERT_SECTION_EMBEDDINGS;
+    int64_t time_us = 0;
+    uint64_t counters[BERT_COUNTER_COUNT] = {}; // only filled with counters enabled
+};
+
+// accumulated over every forward since profiling was enabled or last reset. nodes run
+// one by one while profiling, so totals include a dispatch per node and exceed the
+// unprofiled latency; use it for the relative breakdown
+struct bert_profile {
+    uint64_t n_forward = 0;
+    int64_t total_us = 0;                        // sum of all node times
+    int64_t section_us[BERT_SECTION_COUNT] = {};
+    std::vector<int64_t> stage_us;               // embeddings, then one per layer, then pooling
+    std::map<std::string, bert_profile_op> ops;  // keyed by op, unary ops by their own name (gelu)
+    std::vector<bert_profile_region> regions;    // in graph order
+    bool counters = false;                       // regions carry hardware counters
+};
+
+struct bert_trace_params {
+    size_t max_events = 1 << 20; // later spans are counted but dropped
+    bool nodes = false;          // a span per graph node; nodes then run one at a time, which slows compute down
+};
+
+// times the enclosing scope while tracing is on, a single relaxed atomic load when it is off
+struct bert_trace_span {
+    const char * name;
+    const char * cat;
+    int64_t t_start_us = -1; // -1 when tracing was off at construction
+    std::string args;
+
+    bert_trace_span(const char * name, const char * cat);
+    ~bert_trace_span();
+
+    // shown in the span's details
+    void arg(const char * key, int64_t value);
+};
+
+struct bert_registry;
+
+struct bert_registry_params {
+    bert_load_params load;
+    int64_t memory_budget = 0;  // bytes of weights + compute buffers kept resident, 0 = unlimited
+    int32_t n_max_tokens = 0;   // compute buffer shape, 0 = the model's maximum
+    int32_t batch_size = 32;
+    bool warmup = false;        // warm every model before it is handed out (or swapped in)
+    bert_warmup_params warmup_params;
+    bool start_batcher = true;  // give every loaded model its own batcher
+    bert_batcher_params batcher;
+};
+
+struct bert_registry_stats {
+    int32_t n_models = 0;       // registered
+    int32_t n_resident = 0;     // currently loaded and owned by the registry
+    int64_t bytes_resident = 0;
+    uint64_t n_hits = 0;        // lookups served by a resident model
+    uint64_t n_loads = 0;
+    uint64_t n_load_failures = 0;
+    uint64_t n_evictions = 0;
+    uint64_t n_swaps = 0;       // resident models replaced by bert_registry_reload
+    bert_histogram load_us;     // load latency including buffer allocation
+};
+
 struct bert_ctx {
     bert_model model;
     bert_vocab vocab;
@@ -109,6 +380,53 @@ struct bert_ctx {
     ggml_backend_buffer_t weights_buffer = NULL;
     ggml_backend_buffer_t compute_buffer = NULL;
     ggml_allocr * compute_alloc = NULL;
+
+    // how the model was loaded, and the file mapping backing the weights if mmap'd
+    bert_load_params params;
+    void * mmap_addr = NULL;
+    size_t mmap_size = 0;
+
+    // node index where each stage (embeddings, every layer, pooling) of the last built graph ends
+    std::vector<int> stage_nodes;
+
+    // node index where each section of the last built graph ends, and which section that is
+    std::vector<std::pair<int, bert_section>> section_nodes;
+
+    // mapped weight pages each stage reads, for layer streaming
+    std::vector<std::pair<void *, size_t>> stage_weights;
+
+    // memory pinned with mlock, released on free
+    std::vector<std::pair<void *, size_t>> mlock_weights;
+    size_t mlock_weights_bytes = 0;
+    size_t mlock_compute_bytes = 0;
+
+    // serializes use of the compute buffer so callers may share a context across threads
+    std::mutex compute_mutex;
+
+    // shape the compute buffer was measured for
+    int32_t buf_n_max_tokens = 0;
+    int32_t buf_batch_size = 0;
+
+    // allocator high water mark in the compute buffer
+    std::atomic<size_t> compute_peak{0};
+
+    // set once bert_warmup has run
+    std::atomic<bool> warm{false};
+
+    // production telemetry, always on
+    bert_metrics_counters metrics;
+
+    // per node timing of every forward, off by default
+    std::atomic<bool> profiling{false};
+    std::atomic<bool> profile_counters{false};
+    std::mutex profile_mutex;
+    bert_profile profile;
+
+    // dynamic batching worker (optional)
+    bert_batcher * batcher = NULL;
+
+    // c submission api state (optional)
+    bert_completion * completion = NULL;
 };
 
 //
@@ -120,6 +438,13 @@ BERT_API struct bert_ctx * bert_load_from_file(
     bool use_cpu
 );
 
+// with use_mmap, load in a parent process and call bert_allocate_buffers in each
+// forked child: the weights stay shared, only the compute buffers are private
+BERT_API struct bert_ctx * bert_load_from_file_ext(
+    const char * fname,
+    bert_load_params params
+);
+
 BERT_API void bert_allocate_buffers(
     bert_ctx * ctx,
     int32_t n_max_tokens,
@@ -127,6 +452,12 @@ BERT_API void bert_allocate_buffers(
 );
 
 BERT_API void bert_deallocate_buffers(bert_ctx * ctx);
+
+// bytes of weights and compute buffer currently pinned with mlock
+BERT_API size_t bert_locked_bytes(bert_ctx * ctx);
+
+// memory held by the context, broken down for capacity planning
+BERT_API void bert_get_memory(bert_ctx * ctx, bert_memory * memory);
 BERT_API void bert_free(bert_ctx * ctx);
 
 BERT_API ggml_cgraph * bert_build_graph(
@@ -156,6 +487,38 @@ BERT_API void bert_encode_batch_c(
     int32_t n_threads
 );
 
+// all texts packed in one utf-8 buffer: text i is buf[offsets[i]:offsets[i + 1]]
+BERT_API void bert_encode_batch_buf_c(
+    struct bert_ctx * ctx,
+    const char * buf,
+    const int64_t * offsets,
+    int32_t n_input,
+    float * embeddings,
+    int32_t n_threads
+);
+
+// same input as bert_encode_batch_buf_c, but a worker tokenizes the next
+// chunk while the current one computes, for long bulk jobs
+BERT_API void bert_encode_stream_c(
+    struct bert_ctx * ctx,
+    const char * buf,
+    const int64_t * offsets,
+    int32_t n_input,
+    float * embeddings,
+    int32_t n_threads
+);
+
+// pre-tokenized input in csr form: sequence i is ids[offsets[i]:offsets[i + 1]]
+// if any id is outside the vocab nothing is computed and embeddings is left untouched
+BERT_API void bert_forward_batch_csr_c(
+    struct bert_ctx * ctx,
+    const int32_t * ids,
+    const int64_t * offsets,
+    int32_t n_input,
+    float * embeddings,
+    int32_t n_threads
+);
+
 BERT_API bert_tokens bert_tokenize(
     struct bert_ctx * ctx,
     bert_string text,
@@ -169,6 +532,22 @@ BERT_API uint64_t bert_tokenize_c(
     uint64_t n_max_tokens
 );
 
+// tokenize many texts at once into csr form: sequence i is ids[ids_offsets[i]:ids_offsets[i + 1]]
+// texts are packed as in bert_encode_batch_buf_c and ids_offsets holds n_input + 1 entries.
+// returns the total number of ids, if that exceeds capacity nothing is written so the
+// caller can grow ids and retry. sum(min(bytes + 2, n_max_tokens)) is always enough.
+BERT_API int64_t bert_tokenize_batch_c(
+    struct bert_ctx * ctx,
+    const char * buf,
+    const int64_t * offsets,
+    int32_t n_input,
+    uint64_t n_max_tokens,
+    int32_t * ids,
+    int64_t capacity,
+    int64_t * ids_offsets,
+    int32_t n_threads
+);
+
 BERT_API void bert_forward(
     struct bert_ctx * ctx,
     bert_tokens tokens,
@@ -183,8 +562,190 @@ BERT_API void bert_encode(
     int32_t n_threads
 );
 
+// fault in the weights and compute buffer and run one forward per shape bucket,
+// so the first real request sees steady state latency. needs allocated buffers
+BERT_API bool bert_warmup(
+    struct bert_ctx * ctx,
+    const bert_warmup_params & params
+);
+
+//
+// profiling
+//
+
+// takes effect from the next forward, enabling keeps what was collected so far
+BERT_API void bert_profile_enable(struct bert_ctx * ctx, bool enable);
+
+// read cpu cycles, instructions and last level cache references and misses around every
+// region of the forward (independently of bert_profile_enable, regions run one at a time
+// but nodes do not). linux and the cpu backend only, returns false if the counters cannot
+// be opened, e.g. because of kernel.perf_event_paranoid
+BERT_API bool bert_profile_enable_counters(struct bert_ctx * ctx, bool enable);
+BERT_API void bert_profile_reset(struct bert_ctx * ctx);
+BERT_API void bert_profile_get(struct bert_ctx * ctx, bert_profile * profile);
+BERT_API const char * bert_section_name(bert_section section);
+
+//
+// tracing, chrome trace json that loads in ui.perfetto.dev or chrome://tracing
+//
+
+// buffer spans of every context and thread in memory from now on
+BERT_API void bert_trace_start(bert_trace_params params = bert_trace_params());
+
+// stop tracing and write what was collected, returns false if fname could not be written
+BERT_API bool bert_trace_stop(const char * fname);
+
+// label the calling thread in the timeline, only recorded while tracing
+BERT_API void bert_trace_thread_name(const char * name);
+
+//
+// dynamic batching
+//
+
+// start a worker that groups submitted sequences into batches for bert_forward_batch
+// compute buffers must already be allocated, they bound the batch shape
+BERT_API bool bert_batcher_start(
+    struct bert_ctx * ctx,
+    bert_batcher_params params
+);
+
+// finishes all queued requests before returning
+BERT_API void bert_batcher_stop(struct bert_ctx * ctx);
+
+// on BERT_STATUS_OK the callback is guaranteed to run exactly once, otherwise it never runs
+BERT_API bert_status bert_batcher_submit(
+    struct bert_ctx * ctx,
+    bert_tokens tokens,
+    bert_callback callback,
+    const bert_request_params & params
+);
+
+//
+// async api, runs on the context's batcher (started with default params if needed)
+//
+
+BERT_API std::future<bert_result> bert_encode_async(
+    struct bert_ctx * ctx,
+    bert_string text,
+    const bert_request_params & params = bert_request_params()
+);
+
+BERT_API std::future<bert_result> bert_forward_async(
+    struct bert_ctx * ctx,
+    bert_tokens tokens,
+    const bert_request_params & params = bert_request_params()
+);
+
+BERT_API bert_encode_awaitable bert_encode_co(
+    struct bert_ctx * ctx,
+    bert_string text,
+    const bert_request_params & params = bert_request_params()
+);
+
+//
+// c submission api with streaming completion
+//
+
+// register before submitting, and only change it after bert_flush_c
+BERT_API void bert_set_completion_callback_c(
+    struct bert_ctx * ctx,
+    bert_completion_callback_c callback,
+    void * user_data
+);
+
+// returns how many of the inputs (from the front) were queued, the rest were rejected
+BERT_API int32_t bert_submit_c(
+    struct bert_ctx * ctx,
+    const char ** texts,
+    const uint64_t * tags,
+    int32_t n_input,
+    int32_t priority
+);
+
+// token ids in csr form: sequence i is ids[offsets[i]:offsets[i + 1]]
+// a sequence with an id outside the vocab is rejected like a full queue
+BERT_API int32_t bert_submit_tokens_c(
+    struct bert_ctx * ctx,
+    const int32_t * ids,
+    const int64_t * offsets,
+    const uint64_t * tags,
+    int32_t n_input,
+    int32_t priority
+);
+
+// block until the callback has seen every queued input
+BERT_API void bert_flush_c(struct bert_ctx * ctx);
+
+//
+// model registry, loads models on demand and evicts the least recently used
+// ones to stay within a memory budget
+//
+
+BERT_API struct bert_registry * bert_registry_new(bert_registry_params params);
+
+// frees resident models, contexts handed out earlier stay valid until released
+BERT_API void bert_registry_free(struct bert_registry * registry);
+
+// register (or re-point) a name, nothing is loaded until the first lookup
+BERT_API void bert_registry_add(
+    struct bert_registry * registry,
+    const std::string & name,
+    const std::string & fname
+);
+
+// returns nullptr for unknown names or if loading fails. evicted models are freed once
+// the last holder lets go, so never hold the pointer inside a batcher callback
+BERT_API std::shared_ptr<bert_ctx> bert_registry_get(
+    struct bert_registry * registry,
+    const std::string & name
+);
+
+// the resident model behind name, or nullptr if it is unknown or not loaded. never
+// loads and leaves the lru order and hit counter alone, for monitoring
+BERT_API std::shared_ptr<bert_ctx> bert_registry_peek(
+    struct bert_registry * registry,
+    const std::string & name
+);
+
+// load fname into a fresh context and atomically make it the model behind name,
+// blocking the caller (not lookups) during the load. requests already holding the
+// previous context finish on it, and it is freed when the last of them lets go.
+// on failure the current model stays in place
+BERT_API bool bert_registry_reload(
+    struct bert_registry * registry,
+    const std::string & name,
+    const std::string & fname
+);
+
+BERT_API void bert_registry_get_stats(
+    struct bert_registry * registry,
+    bert_registry_stats * stats
+);
+
+// snapshot of submit-to-callback latency for one priority class
+BERT_API void bert_batcher_latency(
+    struct bert_ctx * ctx,
+    bert_priority priority,
+    bert_histogram * hist
+);
+
+BERT_API void bert_histogram_add(bert_histogram * hist, int64_t value);
+BERT_API int64_t bert_histogram_quantile(const bert_histogram * hist, double q);
+
+// largest value that lands in the bucket, for exporting the buckets
+BERT_API int64_t bert_histogram_bucket_max(int bucket);
+
+// counters since the context was loaded, plus current queue depth and memory
+BERT_API void bert_get_metrics(struct bert_ctx * ctx, bert_metrics * metrics);
+BERT_API const char * bert_phase_name(bert_phase phase);
+
+// record time spent in a phase, for callers that do that work themselves. bert_tokenize
+// is not timed, so whoever tokenizes a request or batch observes BERT_PHASE_TOKENIZE once
+BERT_API void bert_metrics_observe_phase(struct bert_ctx * ctx, bert_phase phase, int64_t us);
+
 BERT_API int32_t bert_n_embd(bert_ctx * ctx);
 BERT_API int32_t bert_n_max_tokens(bert_ctx * ctx);
+BERT_API int32_t bert_n_vocab(bert_ctx * ctx);
 
 BERT_API const char* bert_vocab_id_to_token(bert_ctx * ctx, bert_token id);
 
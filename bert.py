@@ -66,8 +66,28 @@ def increment_pointer(p, d):
     v.value += d * ctypes.sizeof(t)
     return ctypes.cast(v, ctypes.POINTER(t))
 
+def pack_strings(strings):
+    # one utf-8 buffer plus int64 offsets, string i is buf[offsets[i]:offsets[i+1]]
+    encoded = [s.encode('utf-8') for s in strings]
+    offsets = np.zeros(len(encoded) + 1, dtype=np.int64)
+    np.cumsum([len(b) for b in encoded], out=offsets[1:])
+    return b''.join(encoded), offsets
+
+# batches handed to the C streaming loop per call when prefetching
+PREFETCH_BATCHES = 16
+
+class bert_load_params(ctypes.Structure):
+    _fields_ = [
+        ('use_cpu', ctypes.c_bool),
+        ('use_mmap', ctypes.c_bool),
+        ('use_mlock', ctypes.c_bool),
+        ('mlock_compute', ctypes.c_bool),
+        ('stream_layers', ctypes.c_bool),
+        ('n_layer', ctypes.c_int32),
+    ]
+
 class BertModel:
-    def __init__(self, fname, batch_size=32, use_cpu=False, verbose=False):
+    def __init__(self, fname, batch_size=32, use_cpu=False, verbose=False, use_mmap=False, use_mlock=False, stream_layers=False, n_layer=0, allocate=True):
         # set up ctypes for library
         self.lib = ctypes.cdll.LoadLibrary(LIB_PATH)
 
@@ -77,6 +97,12 @@ class BertModel:
             ctypes.c_bool,   # bool use_cpu
         ]
 
+        self.lib.bert_load_from_file_ext.restype = ctypes.c_void_p
+        self.lib.bert_load_from_file_ext.argtypes = [
+            ctypes.c_char_p,  # const char * fname
+            bert_load_params, # bert_load_params params
+        ]
+
         self.lib.bert_allocate_buffers.restype = ctypes.c_void_p
         self.lib.bert_allocate_buffers.argtypes = [
             ctypes.c_void_p, # bert_ctx * ctx
@@ -90,6 +116,9 @@ class BertModel:
         self.lib.bert_n_max_tokens.restype = ctypes.c_int32
         self.lib.bert_n_max_tokens.argtypes = [ctypes.c_void_p]
 
+        self.lib.bert_n_vocab.restype = ctypes.c_int32
+        self.lib.bert_n_vocab.argtypes = [ctypes.c_void_p]
+
         self.lib.bert_free.argtypes = [ctypes.c_void_p]
 
         self.lib.bert_tokenize_c.restype = ctypes.c_uint64
@@ -108,19 +137,67 @@ class BertModel:
             ctypes.c_int32,                  # int32_t n_threads
         ]
 
+        self.lib.bert_encode_batch_buf_c.argtypes = [
+            ctypes.c_void_p,                 # struct bert_ctx * ctx
+            ctypes.c_char_p,                 # const char * buf
+            ctypes.POINTER(ctypes.c_int64),  # const int64_t * offsets
+            ctypes.c_int32,                  # int32_t n_input
+            ctypes.POINTER(ctypes.c_float),  # float * embeddings
+            ctypes.c_int32,                  # int32_t n_threads
+        ]
+
+        self.lib.bert_encode_stream_c.argtypes = [
+            ctypes.c_void_p,                 # struct bert_ctx * ctx
+            ctypes.c_char_p,                 # const char * buf
+            ctypes.POINTER(ctypes.c_int64),  # const int64_t * offsets
+            ctypes.c_int32,                  # int32_t n_input
+            ctypes.POINTER(ctypes.c_float),  # float * embeddings
+            ctypes.c_int32,                  # int32_t n_threads
+        ]
+
+        self.lib.bert_tokenize_batch_c.restype = ctypes.c_int64
+        self.lib.bert_tokenize_batch_c.argtypes = [
+            ctypes.c_void_p,                 # struct bert_ctx * ctx
+            ctypes.c_char_p,                 # const char * buf
+            ctypes.POINTER(ctypes.c_int64),  # const int64_t * offsets
+            ctypes.c_int32,                  # int32_t n_input
+            ctypes.c_uint64,                 # uint64_t n_max_tokens
+            ctypes.POINTER(ctypes.c_int32),  # int32_t * ids
+            ctypes.c_int64,                  # int64_t capacity
+            ctypes.POINTER(ctypes.c_int64),  # int64_t * ids_offsets
+            ctypes.c_int32,                  # int32_t n_threads
+        ]
+
+        self.lib.bert_forward_batch_csr_c.argtypes = [
+            ctypes.c_void_p,                 # struct bert_ctx * ctx
+            ctypes.POINTER(ctypes.c_int32),  # const int32_t * ids
+            ctypes.POINTER(ctypes.c_int64),  # const int64_t * offsets
+            ctypes.c_int32,                  # int32_t n_input
+            ctypes.POINTER(ctypes.c_float),  # float * embeddings
+            ctypes.c_int32,                  # int32_t n_threads
+        ]
+
         # load model from file
+        params = bert_load_params(use_cpu=use_cpu, use_mmap=use_mmap, use_mlock=use_mlock, mlock_compute=use_mlock, stream_layers=stream_layers, n_layer=n_layer)
         with suppress_stdout_stderr(disable=verbose):
-            self.ctx = self.lib.bert_load_from_file(fname.encode('utf-8'), use_cpu)
+            self.ctx = self.lib.bert_load_from_file_ext(fname.encode('utf-8'), params)
         if not self.ctx:
             raise ValueError(f'Failed to load model from file: {fname}')
 
         # get model dimensions
         self.n_embd = self.lib.bert_n_embd(self.ctx)
         self.n_max_tokens = self.lib.bert_n_max_tokens(self.ctx)
+        self.n_vocab = self.lib.bert_n_vocab(self.ctx)
         self.batch_size = batch_size
+        self.verbose = verbose
+
+        # pre-fork pools pass allocate=False and call allocate_buffers in each worker
+        if allocate:
+            self.allocate_buffers()
 
+    def allocate_buffers(self):
         # allocate compute buffers
-        with suppress_stdout_stderr(disable=verbose):
+        with suppress_stdout_stderr(disable=self.verbose):
             self.lib.bert_allocate_buffers(self.ctx, self.n_max_tokens, self.batch_size)
 
     def __del__(self):
@@ -134,6 +211,35 @@ class BertModel:
         n_tokens = self.lib.bert_tokenize_c(self.ctx, text.encode('utf-8'), tokens_p, n_max_tokens)
         return tokens[:n_tokens]
 
+    def tokenize_batch(self, texts, n_max_tokens=None, n_threads=8):
+        # returns (ids, offsets) with sequence i at ids[offsets[i]:offsets[i+1]]
+        if n_max_tokens is None:
+            n_max_tokens = self.lib.bert_n_max_tokens(self.ctx)
+        n_input = len(texts)
+        buf, offsets = pack_strings(texts)
+        offsets_p = offsets.ctypes.data_as(ctypes.POINTER(ctypes.c_int64))
+
+        # every token covers at least one byte, plus [CLS] and [SEP]
+        capacity = int(np.minimum(np.diff(offsets) + 2, n_max_tokens).sum())
+        ids_offsets = np.zeros(n_input + 1, dtype=np.int64)
+        ids_offsets_p = ids_offsets.ctypes.data_as(ctypes.POINTER(ctypes.c_int64))
+        while True:
+            ids = np.zeros(capacity, dtype=np.int32)
+            ids_p = ids.ctypes.data_as(ctypes.POINTER(ctypes.c_int32))
+            n_total = self.lib.bert_tokenize_batch_c(
+                self.ctx, buf, offsets_p, n_input, n_max_tokens, ids_p, capacity, ids_offsets_p, n_threads
+            )
+            if n_total <= capacity:
+                return ids[:n_total], ids_offsets
+            capacity = n_total
+
+    def _output(self, n_input, out):
+        if out is None:
+            return np.zeros((n_input, self.n_embd), dtype=np.float32)
+        if out.dtype != np.float32 or out.shape != (n_input, self.n_embd) or not out.flags.c_contiguous:
+            raise ValueError(f'out must be a C-contiguous float32 array of shape ({n_input}, {self.n_embd})')
+        return out
+
     def embed_batch(self, batch, embed_p=None, n_threads=8):
         # create embedding memory
         n_input = len(batch)
@@ -143,19 +249,34 @@ class BertModel:
         else:
             embed = None
 
-        # create batch strings
-        strings = (ctypes.c_char_p * n_input)()
-        for j, s in enumerate(batch):
-            strings[j] = s.encode('utf-8')
+        # pack all strings into one buffer plus offsets
+        buf, offsets = pack_strings(batch)
+        offsets_p = offsets.ctypes.data_as(ctypes.POINTER(ctypes.c_int64))
 
-        # call bert.cpp function
-        self.lib.bert_encode_batch_c(self.ctx, strings, embed_p, n_input, n_threads)
+        # call bert.cpp function (ctypes releases the GIL for the duration)
+        self.lib.bert_encode_batch_buf_c(self.ctx, buf, offsets_p, n_input, embed_p, n_threads)
 
         # return if it wasn't inplace
         if embed is not None:
             return embed
 
-    def embed(self, text, progress=False):
+    def embed_tokens(self, ids, offsets, out=None, n_threads=8):
+        # pre-tokenized input in CSR form: sequence i is ids[offsets[i]:offsets[i+1]]
+        ids = np.ascontiguousarray(ids, dtype=np.int32)
+        offsets = np.ascontiguousarray(offsets, dtype=np.int64)
+        n_input = len(offsets) - 1
+        if len(ids) > 0 and (ids.min() < 0 or ids.max() >= self.n_vocab):
+            raise ValueError(f'token ids must be in [0, {self.n_vocab})')
+        embed = self._output(n_input, out)
+
+        ids_p = ids.ctypes.data_as(ctypes.POINTER(ctypes.c_int32))
+        offsets_p = offsets.ctypes.data_as(ctypes.POINTER(ctypes.c_int64))
+        embed_p = embed.ctypes.data_as(ctypes.POINTER(ctypes.c_float))
+        self.lib.bert_forward_batch_csr_c(self.ctx, ids_p, offsets_p, n_input, embed_p, n_threads)
+
+        return embed
+
+    def embed(self, text, progress=False, out=None, prefetch=False, n_threads=8):
         # handle singleton case
         if isinstance(text, str):
             text = [text]
@@ -165,18 +286,26 @@ class BertModel:
         n_input = len(text)
 
         # create embedding memory
-        embed = np.zeros((n_input, self.n_embd), dtype=np.float32)
+        embed = self._output(n_input, out)
         embed_p = embed.ctypes.data_as(ctypes.POINTER(ctypes.c_float))
 
+        # with prefetch each call streams many batches, tokenizing ahead on a C-side worker
+        step = self.batch_size * (PREFETCH_BATCHES if prefetch else 1)
+
         # loop over batches
-        indices = range(0, n_input, self.batch_size)
+        indices = range(0, n_input, step)
         if progress:
             indices = tqdm(list(indices))
         for i in indices:
-            j = min(i + self.batch_size, n_input)
+            j = min(i + step, n_input)
             batch = text[i:j]
             batch_p = increment_pointer(embed_p, i * self.n_embd)
-            self.embed_batch(batch, embed_p=batch_p)
+            if prefetch:
+                buf, offsets = pack_strings(batch)
+                offsets_p = offsets.ctypes.data_as(ctypes.POINTER(ctypes.c_int64))
+                self.lib.bert_encode_stream_c(self.ctx, buf, offsets_p, j - i, batch_p, n_threads)
+            else:
+                self.embed_batch(batch, embed_p=batch_p, n_threads=n_threads)
 
         # return squeezed maybe
         return embed[0] if squeeze else embed
@@ -0,0 +1,451 @@
+#include "bert.h"
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+struct bench_ops_params
+{
+    const char* model = "models/all-MiniLM-L6-v2/ggml-model-q4_0.bin";
+    std::vector<int32_t> batch_sizes = {1, 32};
+    std::vector<int32_t> seq_lens = {128, 512};
+    std::vector<int32_t> threads = {6};
+    std::vector<ggml_type> types = {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q5_1, GGML_TYPE_Q5_0, GGML_TYPE_Q4_1, GGML_TYPE_Q4_0};
+    std::vector<std::string> ops; // empty = all
+    int32_t n_warmup = 2;
+    int32_t n_iter = 20;
+    bool json = false;
+    bool use_cpu = false;
+};
+
+void bench_ops_print_usage(char **argv, const bench_ops_params &params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "times each op of the graph on its own, at the shapes of the given model\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model the shapes are taken from (default: %s)\n", params.model);
+    fprintf(stderr, "  -b N,N,..., --batch-size N,N,...\n");
+    fprintf(stderr, "                        sequences per forward (default: 1,32)\n");
+    fprintf(stderr, "  -l N,N,..., --seq-len N,N,...\n");
+    fprintf(stderr, "                        tokens per sequence (default: 128,512)\n");
+    fprintf(stderr, "  -t N,N,..., --threads N,N,...\n");
+    fprintf(stderr, "                        number of threads to use during computation (default: 6)\n");
+    fprintf(stderr, "  --types T,T,...       weight types for the matmuls (default: f32,f16,q8_0,q5_1,q5_0,q4_1,q4_0)\n");
+    fprintf(stderr, "  -o OP,OP,..., --ops OP,OP,...\n");
+    fprintf(stderr, "                        only these ops (default: all)\n");
+    fprintf(stderr, "  -w N, --warmup N      untimed runs before each measurement (default: %d)\n", params.n_warmup);
+    fprintf(stderr, "  -r N, --repetitions N timed runs per measurement (default: %d)\n", params.n_iter);
+    fprintf(stderr, "  --json                print results as json instead of a table\n");
+    fprintf(stderr, "  -c, --cpu             use CPU backend (default: use CUDA if available)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "ops: get_rows, norm, norm_affine, gelu, soft_max, soft_max_masked, mul_mat_q, mul_mat_qkv,\n");
+    fprintf(stderr, "     mul_mat_ffn_up, mul_mat_ffn_down, mul_mat_kq, mul_mat_kqv\n");
+    fprintf(stderr, "\n");
+}
+
+static std::vector<std::string> bench_ops_split(const std::string & list) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        items.push_back(list.substr(start, end - start));
+        start = end + 1;
+    }
+    return items;
+}
+
+static std::vector<int32_t> bench_ops_parse_list(const std::string & list) {
+    std::vector<int32_t> values;
+    for (const std::string & item : bench_ops_split(list)) {
+        values.push_back(std::stoi(item));
+    }
+    return values;
+}
+
+bool bench_ops_params_parse(int argc, char **argv, bench_ops_params &params) {
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "-m" || arg == "--model") {
+            params.model = argv[++i];
+        } else if (arg == "-b" || arg == "--batch-size") {
+            params.batch_sizes = bench_ops_parse_list(argv[++i]);
+        } else if (arg == "-l" || arg == "--seq-len") {
+            params.seq_lens = bench_ops_parse_list(argv[++i]);
+        } else if (arg == "-t" || arg == "--threads") {
+            params.threads = bench_ops_parse_list(argv[++i]);
+        } else if (arg == "--types") {
+            params.types.clear();
+            for (const std::string & name : bench_ops_split(argv[++i])) {
+                int t = 0;
+                while (t < GGML_TYPE_COUNT && (ggml_type_name((ggml_type) t) == nullptr || name != ggml_type_name((ggml_type) t))) {
+                    t++;
+                }
+                if (t == GGML_TYPE_COUNT) {
+                    fprintf(stderr, "error: unknown type: %s\n", name.c_str());
+                    return false;
+                }
+                params.types.push_back((ggml_type) t);
+            }
+        } else if (arg == "-o" || arg == "--ops") {
+            params.ops = bench_ops_split(argv[++i]);
+        } else if (arg == "-w" || arg == "--warmup") {
+            params.n_warmup = std::stoi(argv[++i]);
+        } else if (arg == "-r" || arg == "--repetitions") {
+            params.n_iter = std::stoi(argv[++i]);
+        } else if (arg == "--json") {
+            params.json = true;
+        } else if (arg == "-c" || arg == "--cpu") {
+            params.use_cpu = true;
+        } else if (arg == "-h" || arg == "--help") {
+            bench_ops_print_usage(argv, params);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            bench_ops_print_usage(argv, params);
+            exit(0);
+        }
+    }
+
+    if (params.batch_sizes.empty() || params.seq_lens.empty() || params.threads.empty() || params.n_iter < 1) {
+        fprintf(stderr, "error: every sweep needs at least one value and at least one repetition\n");
+        return false;
+    }
+
+    return true;
+}
+
+//
+// single op graphs
+//
+
+struct bench_ops_input {
+    ggml_tensor * tensor;
+    int32_t n_ids; // ids are drawn from [0, n_ids) for i32 inputs
+};
+
+struct bench_ops_result {
+    std::string op;
+    std::string type;
+    std::string shape;
+    int32_t batch_size;
+    int32_t seq_len;
+    int32_t n_threads;
+    double p50_us;
+    double flops;
+    double bytes;
+};
+
+// a weight matmul, [K, N] weights times [K, T] activations
+struct bench_ops_matmul {
+    const char * op;
+    int64_t K;
+    int64_t N;
+};
+
+// creates the inputs of one op (or short chain) in ctx0 and returns its output
+typedef std::function<ggml_tensor * (ggml_context * ctx0, std::vector<bench_ops_input> & inputs)> bench_ops_builder;
+
+static ggml_tensor * bench_ops_new_input(ggml_context * ctx0, std::vector<bench_ops_input> & inputs, ggml_type type,
+        int64_t ne0, int64_t ne1 = 1, int64_t ne2 = 1, int64_t ne3 = 1, int32_t n_ids = 0) {
+    ggml_tensor * t = ggml_new_tensor_4d(ctx0, type, ne0, ne1, ne2, ne3);
+    inputs.push_back({t, n_ids});
+    return t;
+}
+
+// random values in [-1, 1], quantized or converted to the tensor's type
+static void bench_ops_fill(const bench_ops_input & input, std::mt19937 & rng) {
+    ggml_tensor * t = input.tensor;
+    const int64_t n = ggml_nelements(t);
+
+    if (t->type == GGML_TYPE_I32) {
+        std::vector<int32_t> ids(n);
+        for (int32_t & id : ids) {
+            id = rng() % std::max(input.n_ids, 1);
+        }
+        ggml_backend_tensor_set(t, ids.data(), 0, ggml_nbytes(t));
+        return;
+    }
+
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> values(n);
+    for (float & v : values) {
+        v = dist(rng);
+    }
+
+    std::vector<uint8_t> data(ggml_nbytes(t));
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(data.data(), values.data(), data.size());
+    } else if (t->type == GGML_TYPE_F16) {
+        ggml_fp32_to_fp16_row(values.data(), (ggml_fp16_t *) data.data(), n);
+    } else {
+        std::vector<int64_t> hist(1 << 4, 0);
+        ggml_quantize_chunk(t->type, values.data(), data.data(), 0, n, hist.data());
+    }
+    ggml_backend_tensor_set(t, data.data(), 0, data.size());
+}
+
+// times the graph computing the builder's output. every tensor gets its own memory, so nothing
+// runs in place and the inputs keep their values across repetitions
+static bool bench_ops_run(bert_ctx * ctx, const bench_ops_params & params, int32_t n_threads, const bench_ops_builder & build,
+        double flops, bench_ops_result & result) {
+    ggml_backend_t backend = ctx->backend;
+
+    std::vector<uint8_t> meta(16 * ggml_tensor_overhead() + ggml_graph_overhead());
+    struct ggml_init_params ggml_params = {
+        /*.mem_size   =*/ meta.size(),
+        /*.mem_buffer =*/ meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx0 = ggml_init(ggml_params);
+
+    std::vector<bench_ops_input> inputs;
+    ggml_tensor * out = build(ctx0, inputs);
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+    ggml_build_forward_expand(gf, out);
+
+    // room for every tensor plus alignment padding
+    size_t buf_size = 0;
+    for (ggml_tensor * t = ggml_get_first_tensor(ctx0); t != NULL; t = ggml_get_next_tensor(ctx0, t)) {
+        buf_size += ggml_nbytes(t) + 256;
+    }
+    ggml_backend_buffer_t buffer = ggml_backend_alloc_buffer(backend, buf_size);
+    if (buffer == NULL) {
+        fprintf(stderr, "%s: failed to allocate %.2f MB for %s\n", __func__, buf_size / 1024.0 / 1024.0, result.op.c_str());
+        ggml_free(ctx0);
+        return false;
+    }
+    ggml_allocr * alloc = ggml_allocr_new_from_buffer(buffer);
+    for (ggml_tensor * t = ggml_get_first_tensor(ctx0); t != NULL; t = ggml_get_next_tensor(ctx0, t)) {
+        ggml_allocr_alloc(alloc, t);
+    }
+
+    std::mt19937 rng(42);
+    double bytes = ggml_nbytes(out);
+    for (const bench_ops_input & input : inputs) {
+        bench_ops_fill(input, rng);
+        bytes += ggml_nbytes(input.tensor);
+    }
+
+    if (ggml_backend_is_cpu(backend)) {
+        ggml_backend_cpu_set_n_threads(backend, n_threads);
+    }
+
+    std::vector<int64_t> times;
+    for (int32_t it = 0; it < params.n_warmup + params.n_iter; it++) {
+        const int64_t t_start_us = ggml_time_us();
+        ggml_backend_graph_compute(backend, gf);
+        ggml_backend_synchronize(backend);
+        if (it >= params.n_warmup) {
+            times.push_back(ggml_time_us() - t_start_us);
+        }
+    }
+    std::sort(times.begin(), times.end());
+
+    result.n_threads = n_threads;
+    result.p50_us = times[times.size() / 2];
+    result.flops = flops;
+    if (result.bytes == 0.0) {
+        result.bytes = bytes;
+    }
+
+    ggml_allocr_free(alloc);
+    ggml_backend_buffer_free(buffer);
+    ggml_free(ctx0);
+
+    return true;
+}
+
+//
+// report
+//
+
+static void bench_ops_print_row(const bench_ops_result & r) {
+    const double s = std::max(r.p50_us, 1.0) / 1e6;
+    char gflops[32] = "-";
+    if (r.flops > 0.0) {
+        snprintf(gflops, sizeof(gflops), "%.1f", r.flops / s / 1e9);
+    }
+    printf("| %-16s | %-4s | %-30s | %5d | %5d | %3d | %10.1f | %9s | %8.1f |\n",
+        r.op.c_str(), r.type.c_str(), r.shape.c_str(), r.batch_size, r.seq_len, r.n_threads, r.p50_us, gflops, r.bytes / s / 1e9);
+    fflush(stdout);
+}
+
+static void bench_ops_print_json(const std::vector<bench_ops_result> & results) {
+    printf("[\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_ops_result & r = results[i];
+        printf("  {\"op\": \"%s\", \"type\": \"%s\", \"shape\": \"%s\", \"batch_size\": %d, \"seq_len\": %d, \"threads\": %d, "
+            "\"p50_us\": %.1f, \"flops\": %.0f, \"bytes\": %.0f}%s\n",
+            r.op.c_str(), r.type.c_str(), r.shape.c_str(), r.batch_size, r.seq_len, r.n_threads,
+            r.p50_us, r.flops, r.bytes, i + 1 < results.size() ? "," : "");
+    }
+    printf("]\n");
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    bench_ops_params params;
+    if (bench_ops_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    // only the hparams and the backend are used, mapping keeps the weights out of memory
+    bert_load_params lparams;
+    lparams.use_cpu = params.use_cpu;
+    lparams.use_mmap = true;
+    bert_ctx * ctx = bert_load_from_file_ext(params.model, lparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model);
+        return 1;
+    }
+
+    const bert_hparams & hparams = ctx->model.hparams;
+    const int64_t E = hparams.n_embd;
+    const int64_t I = hparams.n_intermediate;
+    const int64_t H = hparams.n_head;
+    const int64_t D = E / H;
+    const int64_t V = hparams.n_vocab;
+    const float eps = hparams.layer_norm_eps;
+    const ggml_type embd_type = ctx->model.word_embeddings->type;
+
+    auto wanted = [&](const char * op) {
+        return params.ops.empty() || std::find(params.ops.begin(), params.ops.end(), op) != params.ops.end();
+    };
+
+    if (!params.json) {
+        printf("| %-16s | %-4s | %-30s | %5s | %5s | %3s | %10s | %9s | %8s |\n",
+            "op", "type", "shape", "batch", "len", "thr", "p50 us", "GFLOP/s", "GB/s");
+        printf("|------------------|------|--------------------------------|-------|-------|-----|------------|-----------|----------|\n");
+    }
+
+    std::vector<bench_ops_result> results;
+    bool ok = true;
+    for (int32_t B : params.batch_sizes) {
+    for (int32_t L : params.seq_lens) {
+    for (int32_t n_threads : params.threads) {
+        const int64_t T = (int64_t) B * L;
+
+        auto run = [&](const char * op, ggml_type type, const std::string & shape, double flops, double bytes, const bench_ops_builder & build) {
+            if (!wanted(op)) {
+                return;
+            }
+            bench_ops_result r = { op, ggml_type_name(type), shape, B, L, n_threads, 0.0, 0.0, bytes };
+            if (!bench_ops_run(ctx, params, n_threads, build, flops, r)) {
+                ok = false;
+                return;
+            }
+            results.push_back(r);
+            if (!params.json) {
+                bench_ops_print_row(r);
+            }
+        };
+        auto dims = [](std::initializer_list<int64_t> ne) {
+            std::string s;
+            for (int64_t n : ne) {
+                s += (s.empty() ? "" : "x") + std::to_string(n);
+            }
+            return s;
+        };
+
+        // embedding lookup reads one row per token, not the whole table
+        const double row_bytes = (double) ggml_type_size(embd_type) * E / ggml_blck_size(embd_type);
+        run("get_rows", embd_type, dims({E, V}) + " [" + std::to_string(T) + "]", 0.0, T * (row_bytes + sizeof(int32_t) + E * sizeof(float)),
+            [&](ggml_context * ctx0, std::vector<bench_ops_input> & in) {
+                ggml_tensor * table = bench_ops_new_input(ctx0, in, embd_type, E, V);
+                ggml_tensor * ids = bench_ops_new_input(ctx0, in, GGML_TYPE_I32, T, 1, 1, 1, V);
+                return ggml_get_rows(ctx0, table, ids);
+            });
+
+        run("norm", GGML_TYPE_F32, dims({E, T}), 0.0, 0.0,
+            [&](ggml_context * ctx0, std::vector<bench_ops_input> & in) {
+                return ggml_norm(ctx0, bench_ops_new_input(ctx0, in, GGML_TYPE_F32, E, T), eps);
+            });
+
+        // layer norm as the graph runs it today, the baseline for a fused kernel
+        run("norm_affine", GGML_TYPE_F32, dims({E, T}), 0.0, 0.0,
+            [&](ggml_context * ctx0, std::vector<bench_ops_input> & in) {
+                ggml_tensor * x = bench_ops_new_input(ctx0, in, GGML_TYPE_F32, E, T);
+                ggml_tensor * w = bench_ops_new_input(ctx0, in, GGML_TYPE_F32, E);
+                ggml_tensor * b = bench_ops_new_input(ctx0, in, GGML_TYPE_F32, E);
+                return ggml_add(ctx0, ggml_mul(ctx0, ggml_norm(ctx0, x, eps), w), b);
+            });
+
+        run("gelu", GGML_TYPE_F32, dims({I, T}), 0.0, 0.0,
+            [&](ggml_context * ctx0, std::vector<bench_ops_input> & in) {
+                return ggml_gelu(ctx0, bench_ops_new_input(ctx0, in, GGML_TYPE_F32, I, T));
+            });
+
+        run("soft_max", GGML_TYPE_F32, dims({L, L, H, B}), 0.0, 0.0,
+            [&](ggml_context * ctx0, std::vector<bench_ops_input> & in) {
+                return ggml_soft_max(ctx0, bench_ops_new_input(ctx0, in, GGML_TYPE_F32, L, L, H, B));
+            });
+
+        // scale, padding mask and soft max as the graph runs them today
+        run("soft_max_masked", GGML_TYPE_F32, dims({L, L, H, B}), 0.0, 0.0,
+            [&](ggml_context * ctx0, std::vector<bench_ops_input> & in) {
+                ggml_tensor * kq = bench_ops_new_input(ctx0, in, GGML_TYPE_F32, L, L, H, B);
+                ggml_tensor * mask = bench_ops_new_input(ctx0, in, GGML_TYPE_F32, L, L, 1, B);
+                return ggml_soft_max(ctx0, ggml_add(ctx0, ggml_scale(ctx0, kq, 1.0f / sqrtf((float) D)), mask));
+            });
+
+        // weight matmuls at every type
+        const bench_ops_matmul matmuls[] = {
+            { "mul_mat_q",        E, E     }, // each of q, k, v and the attention output
+            { "mul_mat_qkv",      E, 3 * E }, // q, k and v in one fused matmul
+            { "mul_mat_ffn_up",   E, I     },
+            { "mul_mat_ffn_down", I, E     },
+        };
+        for (const auto & mm : matmuls) {
+            for (ggml_type type : params.types) {
+                if (mm.K % ggml_blck_size(type) != 0) {
+                    continue;
+                }
+                run(mm.op, type, dims({mm.K, mm.N}) + " * " + dims({mm.K, T}), 2.0 * mm.K * mm.N * T, 0.0,
+                    [&](ggml_context * ctx0, std::vector<bench_ops_input> & in) {
+                        ggml_tensor * w = bench_ops_new_input(ctx0, in, type, mm.K, mm.N);
+                        ggml_tensor * x = bench_ops_new_input(ctx0, in, GGML_TYPE_F32, mm.K, T);
+                        return ggml_mul_mat(ctx0, w, x);
+                    });
+            }
+        }
+
+        // attention scores and weighted values, per head
+        run("mul_mat_kq", GGML_TYPE_F32, dims({D, L, H, B}) + " * " + dims({D, L, H, B}), 2.0 * D * L * L * H * B, 0.0,
+            [&](ggml_context * ctx0, std::vector<bench_ops_input> & in) {
+                ggml_tensor * k = bench_ops_new_input(ctx0, in, GGML_TYPE_F32, D, L, H, B);
+                ggml_tensor * q = bench_ops_new_input(ctx0, in, GGML_TYPE_F32, D, L, H, B);
+                return ggml_mul_mat(ctx0, k, q);
+            });
+        run("mul_mat_kqv", GGML_TYPE_F32, dims({L, D, H, B}) + " * " + dims({L, L, H, B}), 2.0 * D * L * L * H * B, 0.0,
+            [&](ggml_context * ctx0, std::vector<bench_ops_input> & in) {
+                ggml_tensor * vt = bench_ops_new_input(ctx0, in, GGML_TYPE_F32, L, D, H, B);
+                ggml_tensor * kq = bench_ops_new_input(ctx0, in, GGML_TYPE_F32, L, L, H, B);
+                return ggml_mul_mat(ctx0, vt, kq);
+            });
+    }
+    }
+    }
+
+    if (params.json) {
+        bench_ops_print_json(results);
+    }
+
+    bert_free(ctx);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,295 @@
+#include "bert.h"
+#include "ggml.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct bench_tokenizer_params
+{
+    const char* model = "models/all-MiniLM-L6-v2/ggml-model-q4_0.bin";
+    const char* corpus = nullptr;
+    const char* reference = nullptr;
+    std::vector<int32_t> threads = {1, (int32_t) std::max(1u, std::thread::hardware_concurrency())};
+    int32_t n_iter = 3;
+    int32_t n_show = 0;
+};
+
+void bench_tokenizer_print_usage(char **argv, const bench_tokenizer_params &params) {
+    fprintf(stderr, "usage: %s [options] -f CORPUS\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model path (default: %s)\n", params.model);
+    fprintf(stderr, "  -f FNAME, --file FNAME\n");
+    fprintf(stderr, "                        corpus, one text per line\n");
+    fprintf(stderr, "  -t N,N,..., --threads N,N,...\n");
+    fprintf(stderr, "                        thread counts to measure (default: 1 and all cores)\n");
+    fprintf(stderr, "  -r N, --repetitions N passes over the corpus per thread count, the fastest is reported (default: %d)\n", params.n_iter);
+    fprintf(stderr, "  --reference FNAME     token ids from models/dump-tokens.py to compare against\n");
+    fprintf(stderr, "  --show N              print the first N mismatching lines (default: %d)\n", params.n_show);
+    fprintf(stderr, "\n");
+}
+
+bool bench_tokenizer_params_parse(int argc, char **argv, bench_tokenizer_params &params) {
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "-m" || arg == "--model") {
+            params.model = argv[++i];
+        } else if (arg == "-f" || arg == "--file") {
+            params.corpus = argv[++i];
+        } else if (arg == "-t" || arg == "--threads") {
+            params.threads.clear();
+            std::stringstream ss(argv[++i]);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                params.threads.push_back(std::max(1, std::stoi(item)));
+            }
+        } else if (arg == "-r" || arg == "--repetitions") {
+            params.n_iter = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--reference") {
+            params.reference = argv[++i];
+        } else if (arg == "--show") {
+            params.n_show = std::stoi(argv[++i]);
+        } else if (arg == "-h" || arg == "--help") {
+            bench_tokenizer_print_usage(argv, params);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            bench_tokenizer_print_usage(argv, params);
+            exit(0);
+        }
+    }
+
+    if (params.corpus == nullptr) {
+        fprintf(stderr, "error: no corpus given\n");
+        bench_tokenizer_print_usage(argv, params);
+        return false;
+    }
+
+    return true;
+}
+
+//
+// script detection, by the unicode block most letters of a line fall in
+//
+
+static const char * script_of(uint32_t cp) {
+    if ((cp >= 'A' && cp <= 'Z') || (cp >= 'a' && cp <= 'z') || (cp >= 0xC0 && cp <= 0x24F && cp != 0xD7 && cp != 0xF7) || (cp >= 0x1E00 && cp <= 0x1EFF)) return "latin";
+    if (cp < 0x80) return nullptr; // digits, punctuation, whitespace
+    if (cp >= 0x370 && cp <= 0x3FF) return "greek";
+    if (cp >= 0x400 && cp <= 0x52F) return "cyrillic";
+    if (cp >= 0x530 && cp <= 0x58F) return "armenian";
+    if (cp >= 0x590 && cp <= 0x5FF) return "hebrew";
+    if ((cp >= 0x600 && cp <= 0x6FF) || (cp >= 0x750 && cp <= 0x77F)) return "arabic";
+    if (cp >= 0x900 && cp <= 0x97F) return "devanagari";
+    if (cp >= 0x980 && cp <= 0x9FF) return "bengali";
+    if (cp >= 0xB80 && cp <= 0xBFF) return "tamil";
+    if (cp >= 0xE00 && cp <= 0xE7F) return "thai";
+    if (cp >= 0x10A0 && cp <= 0x10FF) return "georgian";
+    if ((cp >= 0x1100 && cp <= 0x11FF) || (cp >= 0x3130 && cp <= 0x318F) || (cp >= 0xAC00 && cp <= 0xD7AF)) return "hangul";
+    if (cp >= 0x3040 && cp <= 0x30FF) return "kana";
+    if ((cp >= 0x3400 && cp <= 0x4DBF) || (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0x20000 && cp <= 0x2A6DF)) return "han";
+    if ((cp >= 0x2000 && cp <= 0x2BFF) || (cp >= 0x3000 && cp <= 0x303F) || (cp >= 0xFF00 && cp <= 0xFF0F) || (cp >= 0x1F000 && cp <= 0x1FAFF)) return nullptr; // symbols
+    return "other";
+}
+
+static std::string dominant_script(const std::string & text) {
+    std::map<std::string, int> counts;
+    for (size_t i = 0; i < text.size();) {
+        const uint8_t c = text[i];
+        uint32_t cp = c;
+        int len = 1;
+        if (c >= 0xF0) { cp = c & 0x07; len = 4; }
+        else if (c >= 0xE0) { cp = c & 0x0F; len = 3; }
+        else if (c >= 0xC0) { cp = c & 0x1F; len = 2; }
+        for (int j = 1; j < len && i + j < text.size(); j++) {
+            cp = (cp << 6) | (text[i + j] & 0x3F);
+        }
+        i += len;
+
+        if (const char * script = script_of(cp)) {
+            counts[script]++;
+        }
+    }
+
+    std::string best = "none";
+    int best_count = 0;
+    for (const auto & it : counts) {
+        if (it.second > best_count) {
+            best = it.first;
+            best_count = it.second;
+        }
+    }
+    return best;
+}
+
+//
+// timing
+//
+
+// tokenize every line with n_threads workers over contiguous ranges, returns the number of tokens
+static size_t tokenize_all(bert_ctx * ctx, const std::vector<std::string> & lines, std::vector<bert_tokens> & out, int32_t n_threads) {
+    const int32_t n_max_tokens = bert_n_max_tokens(ctx);
+    const size_t n = lines.size();
+    out.resize(n);
+
+    auto worker = [&](int32_t t) {
+        const size_t i0 = n * t / n_threads;
+        const size_t i1 = n * (t + 1) / n_threads;
+        for (size_t i = i0; i < i1; i++) {
+            out[i] = bert_tokenize(ctx, lines[i], n_max_tokens);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int32_t t = 1; t < n_threads; t++) {
+        workers.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    size_t n_tokens = 0;
+    for (const auto & tokens : out) {
+        n_tokens += tokens.size();
+    }
+    return n_tokens;
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    bench_tokenizer_params params;
+    if (bench_tokenizer_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    // only the vocab is needed, mapping the weights keeps them out of memory
+    bert_load_params lparams;
+    lparams.use_cpu = true;
+    lparams.use_mmap = true;
+    bert_ctx * ctx = bert_load_from_file_ext(params.model, lparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model);
+        return 1;
+    }
+
+    // read the corpus
+    std::vector<std::string> lines;
+    size_t n_bytes = 0;
+    {
+        std::ifstream fin(params.corpus);
+        if (!fin) {
+            fprintf(stderr, "%s: failed to open corpus '%s'\n", __func__, params.corpus);
+            bert_free(ctx);
+            return 1;
+        }
+        std::string line;
+        while (std::getline(fin, line)) {
+            n_bytes += line.size();
+            lines.push_back(std::move(line));
+        }
+    }
+    fprintf(stderr, "%s: %zu lines, %.2f MB\n\n", __func__, lines.size(), n_bytes / 1024.0 / 1024.0);
+
+    // throughput, best of n_iter passes per thread count
+    std::vector<bert_tokens> tokens;
+    printf("| %7s | %10s | %12s | %12s |\n", "threads", "MB/s", "tokens/s", "lines/s");
+    printf("|---------|------------|--------------|--------------|\n");
+    for (int32_t n_threads : params.threads) {
+        int64_t best_us = INT64_MAX;
+        size_t n_tokens = 0;
+        for (int32_t it = 0; it < params.n_iter; it++) {
+            const int64_t t_start_us = ggml_time_us();
+            n_tokens = tokenize_all(ctx, lines, tokens, n_threads);
+            best_us = std::min(best_us, ggml_time_us() - t_start_us);
+        }
+        const double s = std::max<int64_t>(best_us, 1) / 1e6;
+        printf("| %7d | %10.2f | %12.0f | %12.0f |\n", n_threads, n_bytes / 1024.0 / 1024.0 / s, n_tokens / s, lines.size() / s);
+    }
+
+    // correctness against the reference dump
+    int ret = 0;
+    if (params.reference) {
+        std::ifstream fref(params.reference);
+        if (!fref) {
+            fprintf(stderr, "%s: failed to open reference '%s'\n", __func__, params.reference);
+            bert_free(ctx);
+            return 1;
+        }
+
+        struct script_stats {
+            size_t n_lines = 0;
+            size_t n_mismatch = 0;
+            size_t n_tokens = 0;
+            size_t n_token_mismatch = 0; // positions that differ, plus any length difference
+        };
+        std::map<std::string, script_stats> stats;
+        script_stats total;
+
+        std::string ref_line;
+        size_t i = 0;
+        int32_t n_shown = 0;
+        for (; i < lines.size() && std::getline(fref, ref_line); i++) {
+            bert_tokens ref;
+            std::stringstream ss(ref_line);
+            bert_token id;
+            while (ss >> id) {
+                ref.push_back(id);
+            }
+
+            const bert_tokens & ours = tokens[i];
+            size_t n_diff = std::max(ours.size(), ref.size()) - std::min(ours.size(), ref.size());
+            for (size_t k = 0; k < std::min(ours.size(), ref.size()); k++) {
+                n_diff += ours[k] != ref[k];
+            }
+
+            for (script_stats * st : {&stats[dominant_script(lines[i])], &total}) {
+                st->n_lines++;
+                st->n_mismatch += n_diff > 0;
+                st->n_tokens += ref.size();
+                st->n_token_mismatch += n_diff;
+            }
+
+            if (n_diff > 0 && n_shown < params.n_show) {
+                n_shown++;
+                fprintf(stderr, "line %zu: %s\n  ours:", i + 1, lines[i].c_str());
+                for (bert_token t : ours) fprintf(stderr, " %d", t);
+                fprintf(stderr, "\n  ref: ");
+                for (bert_token t : ref) fprintf(stderr, " %d", t);
+                fprintf(stderr, "\n");
+            }
+        }
+        if (i != lines.size()) {
+            fprintf(stderr, "%s: reference has %zu lines, corpus has %zu, was it dumped from this corpus?\n", __func__, i, lines.size());
+            ret = 1;
+        }
+
+        printf("\n| %-10s | %8s | %10s | %8s | %12s |\n", "script", "lines", "mismatched", "rate", "token rate");
+        printf("|------------|----------|------------|----------|--------------|\n");
+        stats["all"] = total;
+        for (const auto & it : stats) {
+            const script_stats & st = it.second;
+            printf("| %-10s | %8zu | %10zu | %7.3f%% | %11.4f%% |\n", it.first.c_str(), st.n_lines, st.n_mismatch,
+                st.n_lines ? 100.0 * st.n_mismatch / st.n_lines : 0.0, st.n_tokens ? 100.0 * st.n_token_mismatch / st.n_tokens : 0.0);
+        }
+
+        if (total.n_mismatch > 0) {
+            ret = 1;
+        }
+    }
+
+    bert_free(ctx);
+
+    return ret;
+}
@@ -0,0 +1,495 @@
+#include "bert.h"
+#include "ggml.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+struct bench_params
+{
+    std::vector<std::string> models;
+    std::vector<int32_t> batch_sizes = {1, 8, 32};
+    std::vector<int32_t> seq_lens = {16, 128, 512};
+    std::vector<int32_t> threads = {6};
+    int32_t n_warmup = 1;
+    int32_t n_iter = 10;
+    bool json = false;
+    bool use_cpu = false;
+    bool use_mmap = false;
+    bool profile = false;
+    bool counters = false;
+    double peak_gflops = 0.0;
+    double peak_gbps = 0.0;
+};
+
+void bench_print_usage(char **argv, const bench_params &params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "every combination of the comma separated lists below is timed\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model path, may be repeated\n");
+    fprintf(stderr, "  -b N,N,..., --batch-size N,N,...\n");
+    fprintf(stderr, "                        sequences per forward (default: 1,8,32)\n");
+    fprintf(stderr, "  -l N,N,..., --seq-len N,N,...\n");
+    fprintf(stderr, "                        tokens per sequence, including [CLS] and [SEP] (default: 16,128,512)\n");
+    fprintf(stderr, "  -t N,N,..., --threads N,N,...\n");
+    fprintf(stderr, "                        number of threads to use during computation (default: 6)\n");
+    fprintf(stderr, "  -w N, --warmup N      untimed forwards before each measurement (default: %d)\n", params.n_warmup);
+    fprintf(stderr, "  -r N, --repetitions N timed forwards per measurement (default: %d)\n", params.n_iter);
+    fprintf(stderr, "  --json                print results as json instead of a table\n");
+    fprintf(stderr, "  --mmap                map model weights from the file (CPU only)\n");
+    fprintf(stderr, "  --profile             after each measurement, run -r more forwards with per node timing and report them by section, layer and op\n");
+    fprintf(stderr, "  --counters            same extra forwards with hardware counters per region and a roofline summary (linux, CPU only)\n");
+    fprintf(stderr, "  --peak-gflops X       machine peak for the roofline, classifies regions as compute or memory bound\n");
+    fprintf(stderr, "  --peak-gbps X         machine DRAM bandwidth for the roofline\n");
+    fprintf(stderr, "  -c, --cpu             use CPU backend (default: use CUDA if available)\n");
+    fprintf(stderr, "\n");
+}
+
+static std::vector<int32_t> bench_parse_list(const std::string & list) {
+    std::vector<int32_t> values;
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        values.push_back(std::stoi(list.substr(start, end - start)));
+        start = end + 1;
+    }
+    return values;
+}
+
+bool bench_params_parse(int argc, char **argv, bench_params &params) {
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "-m" || arg == "--model") {
+            params.models.push_back(argv[++i]);
+        } else if (arg == "-b" || arg == "--batch-size") {
+            params.batch_sizes = bench_parse_list(argv[++i]);
+        } else if (arg == "-l" || arg == "--seq-len") {
+            params.seq_lens = bench_parse_list(argv[++i]);
+        } else if (arg == "-t" || arg == "--threads") {
+            params.threads = bench_parse_list(argv[++i]);
+        } else if (arg == "-w" || arg == "--warmup") {
+            params.n_warmup = std::stoi(argv[++i]);
+        } else if (arg == "-r" || arg == "--repetitions") {
+            params.n_iter = std::stoi(argv[++i]);
+        } else if (arg == "--json") {
+            params.json = true;
+        } else if (arg == "--mmap") {
+            params.use_mmap = true;
+        } else if (arg == "--profile") {
+            params.profile = true;
+        } else if (arg == "--counters") {
+            params.counters = true;
+        } else if (arg == "--peak-gflops") {
+            params.peak_gflops = std::stod(argv[++i]);
+        } else if (arg == "--peak-gbps") {
+            params.peak_gbps = std::stod(argv[++i]);
+        } else if (arg == "-c" || arg == "--cpu") {
+            params.use_cpu = true;
+        } else if (arg == "-h" || arg == "--help") {
+            bench_print_usage(argv, params);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            bench_print_usage(argv, params);
+            exit(0);
+        }
+    }
+
+    if (params.models.empty()) {
+        params.models.push_back("models/all-MiniLM-L6-v2/ggml-model-q4_0.bin");
+    }
+    if (params.batch_sizes.empty() || params.seq_lens.empty() || params.threads.empty() || params.n_iter < 1) {
+        fprintf(stderr, "error: every sweep needs at least one value and at least one repetition\n");
+        return false;
+    }
+
+    return true;
+}
+
+struct bench_cost {
+    double flops;
+    double bytes;
+};
+
+static int64_t bench_nbytes(std::initializer_list<const ggml_tensor *> tensors) {
+    int64_t bytes = 0;
+    for (const ggml_tensor * t : tensors) {
+        bytes += ggml_nbytes(t);
+    }
+    return bytes;
+}
+
+// analytic work of one region for b sequences of l tokens. flops come from the matrix shapes,
+// bytes are the weights read once plus every f32 activation each op reads and writes, so
+// they are an estimate of the traffic without cache reuse between ops
+static bench_cost bench_region_cost(bert_ctx * ctx, const bert_profile_region & region, int64_t b, int64_t l) {
+    const bert_model & model = ctx->model;
+    const bert_hparams & hparams = model.hparams;
+    const double E = hparams.n_embd;
+    const double I = hparams.n_intermediate;
+    const double H = hparams.n_head;
+    const double tokens = (double) b * l;
+    const double f32 = sizeof(float);
+
+    switch (region.section) {
+        case BERT_SECTION_EMBEDDINGS: {
+            // three row gathers and two adds
+            const double rows = (double) bench_nbytes({model.word_embeddings, model.token_type_embeddings, model.position_embeddings})
+                / (model.word_embeddings->ne[1] + model.token_type_embeddings->ne[1] + model.position_embeddings->ne[1]) * 3;
+            return {2 * tokens * E, tokens * rows + 5 * tokens * E * f32};
+        }
+        case BERT_SECTION_ATTENTION: {
+            const bert_layer & layer = model.layers[region.stage - 1];
+            const double weights = bench_nbytes({layer.q_w, layer.q_b, layer.k_w, layer.k_b, layer.v_w, layer.v_b, layer.o_w, layer.o_b});
+            // four projections, scores and weighted values, plus scale, mask and softmax on the scores
+            const double flops = 8 * tokens * E * E + 4 * tokens * l * E + 5 * tokens * l * H;
+            return {flops, weights + (30 * tokens * E + 9 * tokens * l * H) * f32};
+        }
+        case BERT_SECTION_FFN: {
+            const bert_layer & layer = model.layers[region.stage - 1];
+            const double weights = bench_nbytes({layer.ff_i_w, layer.ff_i_b, layer.ff_o_w, layer.ff_o_b});
+            return {4 * tokens * E * I + 8 * tokens * I, weights + (7 * tokens * E + 6 * tokens * I) * f32};
+        }
+        case BERT_SECTION_NORM: {
+            return {8 * tokens * E, 6 * tokens * E * f32};
+        }
+        case BERT_SECTION_POOLING: {
+            return {2 * tokens * E + 4 * b * E, 3 * tokens * E * f32};
+        }
+        default: {
+            return {0.0, 0.0};
+        }
+    }
+}
+
+struct bench_result {
+    std::string model;
+    int32_t batch_size;
+    int32_t seq_len;
+    int32_t n_threads;
+    double tokens_per_s;
+    double seqs_per_s;
+    double p50_ms;
+    double p95_ms;
+    double p99_ms;
+    double compute_mb;
+    double peak_rss_mb;
+    bert_profile profile;
+    std::vector<bench_cost> costs; // per profile region
+};
+
+// nearest rank on sorted samples
+static double bench_percentile(const std::vector<int64_t> & sorted, double q) {
+    size_t rank = (size_t) std::max(1.0, std::ceil(q * sorted.size()));
+    return sorted[std::min(rank, sorted.size()) - 1] / 1000.0;
+}
+
+// high water mark of the whole process, so it only grows across the sweep
+static double bench_peak_rss_mb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024.0 / 1024.0;
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+static bool bench_model(const bench_params & params, const std::string & fname, std::vector<bench_result> & results) {
+    bert_load_params lparams;
+    lparams.use_cpu = params.use_cpu;
+    lparams.use_mmap = params.use_mmap;
+    bert_ctx * ctx = bert_load_from_file_ext(fname.c_str(), lparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    // one compute buffer sized for the largest shape in the sweep
+    const int32_t n_max_tokens = bert_n_max_tokens(ctx);
+    const int32_t max_len = std::min(n_max_tokens, *std::max_element(params.seq_lens.begin(), params.seq_lens.end()));
+    const int32_t max_batch = *std::max_element(params.batch_sizes.begin(), params.batch_sizes.end());
+    bert_allocate_buffers(ctx, max_len, max_batch);
+    const double compute_mb = ctx->compute_buffer ? ggml_backend_buffer_get_size(ctx->compute_buffer) / 1024.0 / 1024.0 : 0.0;
+
+    const int32_t n_embd = bert_n_embd(ctx);
+    std::vector<float> embeddings((size_t) max_batch * n_embd);
+
+    const bool counters = params.counters && bert_profile_enable_counters(ctx, true);
+    if (params.counters && !counters) {
+        fprintf(stderr, "%s: continuing without hardware counters\n", __func__);
+    }
+
+    for (int32_t seq_len : params.seq_lens) {
+        if (seq_len < 2 || seq_len > n_max_tokens) {
+            fprintf(stderr, "%s: skipping sequence length %d, the model takes 2 to %d tokens\n", __func__, seq_len, n_max_tokens);
+            continue;
+        }
+
+        // synthetic input, the token ids do not change the amount of work
+        bert_tokens tokens(seq_len);
+        tokens.front() = 101;
+        tokens.back() = 102;
+        for (int32_t i = 1; i < seq_len - 1; i++) {
+            tokens[i] = 1000 + i;
+        }
+
+        for (int32_t batch_size : params.batch_sizes) {
+            bert_batch batch(batch_size, tokens);
+            for (int32_t n_threads : params.threads) {
+                for (int32_t i = 0; i < params.n_warmup; i++) {
+                    bert_forward_batch(ctx, batch, embeddings.data(), n_threads);
+                }
+
+                std::vector<int64_t> samples(params.n_iter);
+                for (int32_t i = 0; i < params.n_iter; i++) {
+                    const int64_t t_start_us = ggml_time_us();
+                    bert_forward_batch(ctx, batch, embeddings.data(), n_threads);
+                    samples[i] = ggml_time_us() - t_start_us;
+                }
+                std::sort(samples.begin(), samples.end());
+
+                int64_t total_us = 0;
+                for (int64_t t : samples) {
+                    total_us += t;
+                }
+                const double mean_s = total_us / 1e6 / params.n_iter;
+
+                bench_result r;
+                r.model = fname;
+                r.batch_size = batch_size;
+                r.seq_len = seq_len;
+                r.n_threads = n_threads;
+                r.tokens_per_s = (double) batch_size * seq_len / mean_s;
+                r.seqs_per_s = batch_size / mean_s;
+                r.p50_ms = bench_percentile(samples, 0.50);
+                r.p95_ms = bench_percentile(samples, 0.95);
+                r.p99_ms = bench_percentile(samples, 0.99);
+                r.compute_mb = compute_mb;
+                r.peak_rss_mb = bench_peak_rss_mb();
+
+                // profiled forwards are slower, so they run separately from the timed ones
+                if (params.profile || counters) {
+                    bert_profile_reset(ctx);
+                    bert_profile_enable(ctx, params.profile);
+                    for (int32_t i = 0; i < params.n_iter; i++) {
+                        bert_forward_batch(ctx, batch, embeddings.data(), n_threads);
+                    }
+                    bert_profile_enable(ctx, false);
+                    bert_profile_get(ctx, &r.profile);
+                    for (const auto & region : r.profile.regions) {
+                        r.costs.push_back(bench_region_cost(ctx, region, batch_size, seq_len));
+                    }
+                }
+
+                results.push_back(r);
+
+                if (!params.json) {
+                    printf("| %-40s | %5d | %5d | %3d | %12.1f | %10.1f | %9.2f | %9.2f | %9.2f | %10.1f | %11.1f |\n",
+                        r.model.c_str(), r.batch_size, r.seq_len, r.n_threads, r.tokens_per_s, r.seqs_per_s,
+                        r.p50_ms, r.p95_ms, r.p99_ms, r.compute_mb, r.peak_rss_mb);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    bert_free(ctx);
+    return true;
+}
+
+static std::string bench_stage_name(size_t stage, size_t n_stages) {
+    if (stage == 0) return "embeddings";
+    if (stage + 1 == n_stages) return "pooling";
+    return "layer " + std::to_string(stage - 1);
+}
+
+static std::string bench_region_name(const bert_profile_region & region, size_t n_stages) {
+    const std::string stage = bench_stage_name(region.stage, n_stages);
+    const std::string section = bert_section_name(region.section);
+    return stage == section ? stage : stage + " " + section;
+}
+
+// per region throughput against the analytic work, with a compute or memory bound verdict
+// when the machine peaks are known. dram traffic is estimated as one cache line per llc miss
+static void bench_print_roofline(const bench_params & params, const bench_result & r) {
+    const bert_profile & p = r.profile;
+    const double n = (double) p.n_forward;
+    const bool roof = params.peak_gflops > 0 && params.peak_gbps > 0;
+
+    printf("\n| %-20s | %8s | %8s | %7s | %5s | %8s | %9s | %7s | %-7s |\n",
+        "region", "ms", "GFLOP/s", "flop/B", "IPC", "LLC miss", "DRAM GB/s", "of roof", "bound");
+    printf("|----------------------|----------|----------|---------|-------|----------|-----------|---------|---------|\n");
+    for (size_t i = 0; i < p.regions.size() && i < r.costs.size(); i++) {
+        const bert_profile_region & region = p.regions[i];
+        const bench_cost & cost = r.costs[i];
+        const double s = std::max<int64_t>(region.time_us, 1) / n / 1e6;
+        const double gflops = cost.flops / s / 1e9;
+        const double intensity = cost.bytes > 0 ? cost.flops / cost.bytes : 0.0;
+
+        std::string ipc = "-", miss = "-", dram = "-", of_roof = "-", bound = "-";
+        char buf[32];
+        if (p.counters) {
+            const uint64_t * c = region.counters;
+            snprintf(buf, sizeof(buf), "%.2f", c[BERT_COUNTER_CYCLES] ? (double) c[BERT_COUNTER_INSTRUCTIONS] / c[BERT_COUNTER_CYCLES] : 0.0);
+            ipc = buf;
+            snprintf(buf, sizeof(buf), "%.1f%%", c[BERT_COUNTER_LLC_REFERENCES] ? 100.0 * c[BERT_COUNTER_LLC_MISSES] / c[BERT_COUNTER_LLC_REFERENCES] : 0.0);
+            miss = buf;
+            snprintf(buf, sizeof(buf), "%.2f", c[BERT_COUNTER_LLC_MISSES] / n * 64 / s / 1e9);
+            dram = buf;
+        }
+        if (roof) {
+            const double attainable = std::min(params.peak_gflops, intensity * params.peak_gbps);
+            snprintf(buf, sizeof(buf), "%.1f%%", 100.0 * gflops / attainable);
+            of_roof = buf;
+            bound = intensity * params.peak_gbps < params.peak_gflops ? "memory" : "compute";
+        }
+
+        printf("| %-20s | %8.3f | %8.1f | %7.2f | %5s | %8s | %9s | %7s | %-7s |\n",
+            bench_region_name(region, p.stage_us.size()).c_str(), s * 1000.0, gflops, intensity,
+            ipc.c_str(), miss.c_str(), dram.c_str(), of_roof.c_str(), bound.c_str());
+    }
+}
+
+// ops sorted by time, most expensive first
+static std::vector<std::pair<std::string, bert_profile_op>> bench_sorted_ops(const bert_profile & profile) {
+    std::vector<std::pair<std::string, bert_profile_op>> ops(profile.ops.begin(), profile.ops.end());
+    std::sort(ops.begin(), ops.end(), [](const auto & a, const auto & b) { return a.second.time_us > b.second.time_us; });
+    return ops;
+}
+
+// per forward averages, as shares of the summed node time
+static void bench_print_profile(const bench_params & params, const bench_result & r) {
+    const bert_profile & p = r.profile;
+    if (p.n_forward == 0) {
+        return;
+    }
+    const double n = (double) p.n_forward;
+    const double total = std::max<int64_t>(p.total_us, 1);
+
+    printf("\n#### %s, batch %d, len %d, %d threads: %.2f ms per profiled forward\n\n",
+        r.model.c_str(), r.batch_size, r.seq_len, r.n_threads, p.total_us / n / 1000.0);
+
+    printf("| %-12s | %9s | %6s |\n", "section", "ms", "%");
+    printf("|--------------|-----------|--------|\n");
+    for (int s = 0; s < BERT_SECTION_COUNT; s++) {
+        printf("| %-12s | %9.3f | %6.1f |\n", bert_section_name((bert_section) s), p.section_us[s] / n / 1000.0, 100.0 * p.section_us[s] / total);
+    }
+
+    printf("\n| %-12s | %9s | %6s |\n", "stage", "ms", "%");
+    printf("|--------------|-----------|--------|\n");
+    for (size_t s = 0; s < p.stage_us.size(); s++) {
+        printf("| %-12s | %9.3f | %6.1f |\n", bench_stage_name(s, p.stage_us.size()).c_str(), p.stage_us[s] / n / 1000.0, 100.0 * p.stage_us[s] / total);
+    }
+
+    if (!p.ops.empty()) {
+        printf("\n| %-12s | %6s | %9s | %6s |\n", "op", "nodes", "ms", "%");
+        printf("|--------------|--------|-----------|--------|\n");
+        for (const auto & op : bench_sorted_ops(p)) {
+            printf("| %-12s | %6.0f | %9.3f | %6.1f |\n", op.first.c_str(), op.second.n_nodes / n, op.second.time_us / n / 1000.0, 100.0 * op.second.time_us / total);
+        }
+    }
+
+    if (params.counters) {
+        bench_print_roofline(params, r);
+    }
+}
+
+static void bench_print_json(const std::vector<bench_result> & results) {
+    printf("[\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result & r = results[i];
+        std::string model;
+        for (char c : r.model) {
+            if (c == '"' || c == '\\') model += '\\';
+            model += c;
+        }
+        printf("  {\"model\": \"%s\", \"batch_size\": %d, \"seq_len\": %d, \"threads\": %d, "
+            "\"tokens_per_s\": %.2f, \"seqs_per_s\": %.2f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f, "
+            "\"compute_buffer_mb\": %.2f, \"peak_rss_mb\": %.2f",
+            model.c_str(), r.batch_size, r.seq_len, r.n_threads, r.tokens_per_s, r.seqs_per_s,
+            r.p50_ms, r.p95_ms, r.p99_ms, r.compute_mb, r.peak_rss_mb);
+
+        // per forward milliseconds
+        const bert_profile & p = r.profile;
+        if (p.n_forward > 0) {
+            const double n = p.n_forward * 1000.0;
+            printf(", \"profile\": {\"forward_ms\": %.3f, \"sections\": {", p.total_us / n);
+            for (int s = 0; s < BERT_SECTION_COUNT; s++) {
+                printf("%s\"%s\": %.3f", s ? ", " : "", bert_section_name((bert_section) s), p.section_us[s] / n);
+            }
+            printf("}, \"stages\": [");
+            for (size_t s = 0; s < p.stage_us.size(); s++) {
+                printf("%s%.3f", s ? ", " : "", p.stage_us[s] / n);
+            }
+            printf("], \"ops\": {");
+            bool first = true;
+            for (const auto & op : bench_sorted_ops(p)) {
+                printf("%s\"%s\": %.3f", first ? "" : ", ", op.first.c_str(), op.second.time_us / n);
+                first = false;
+            }
+            printf("}, \"regions\": [");
+            for (size_t k = 0; k < p.regions.size() && k < r.costs.size(); k++) {
+                const bert_profile_region & region = p.regions[k];
+                printf("%s{\"stage\": %d, \"section\": \"%s\", \"ms\": %.3f, \"flops\": %.0f, \"bytes\": %.0f",
+                    k ? ", " : "", region.stage, bert_section_name(region.section), region.time_us / n, r.costs[k].flops, r.costs[k].bytes);
+                if (p.counters) {
+                    const double f = (double) p.n_forward;
+                    printf(", \"cycles\": %.0f, \"instructions\": %.0f, \"llc_references\": %.0f, \"llc_misses\": %.0f",
+                        region.counters[BERT_COUNTER_CYCLES] / f, region.counters[BERT_COUNTER_INSTRUCTIONS] / f,
+                        region.counters[BERT_COUNTER_LLC_REFERENCES] / f, region.counters[BERT_COUNTER_LLC_MISSES] / f);
+                }
+                printf("}");
+            }
+            printf("]}");
+        }
+
+        printf("}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    printf("]\n");
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    bench_params params;
+    if (bench_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (!params.json) {
+        printf("| %-40s | %5s | %5s | %3s | %12s | %10s | %9s | %9s | %9s | %10s | %11s |\n",
+            "model", "batch", "len", "thr", "tokens/s", "seqs/s", "p50 ms", "p95 ms", "p99 ms", "compute MB", "peak RSS MB");
+        printf("|%s|-------|-------|-----|--------------|------------|-----------|-----------|-----------|------------|-------------|\n",
+            std::string(42, '-').c_str());
+    }
+
+    std::vector<bench_result> results;
+    bool ok = true;
+    for (const auto & model : params.models) {
+        ok = bench_model(params, model, results) && ok;
+    }
+
+    if (params.json) {
+        bench_print_json(results);
+    } else if (params.profile || params.counters) {
+        for (const auto & r : results) {
+            bench_print_profile(params, r);
+        }
+    }
+
+    return ok ? 0 : 1;
+}
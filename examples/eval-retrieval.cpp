@@ -0,0 +1,422 @@
+#include "bert.h"
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct eval_retrieval_params
+{
+    std::vector<std::string> models;
+    const char* queries = nullptr;
+    const char* corpus = nullptr;
+    const char* qrels = nullptr;
+    std::vector<int32_t> layers = {0};
+    std::vector<int32_t> dims = {0};
+    std::vector<int32_t> recall_k = {10, 100};
+    int32_t n_threads = 6;
+    int32_t batch_size = 32;
+    int32_t n_max_tokens = 512;
+    bool use_cpu = false;
+};
+
+void eval_retrieval_print_usage(char **argv, const eval_retrieval_params &params) {
+    fprintf(stderr, "usage: %s [options] -q QUERIES -d CORPUS -r QRELS\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "every combination of models, layer counts and dimensions is evaluated\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model path, may be repeated\n");
+    fprintf(stderr, "  -q FNAME, --queries FNAME\n");
+    fprintf(stderr, "                        queries, one \"id<tab>text\" per line\n");
+    fprintf(stderr, "  -d FNAME, --corpus FNAME\n");
+    fprintf(stderr, "                        documents, one \"id<tab>text\" per line\n");
+    fprintf(stderr, "  -r FNAME, --qrels FNAME\n");
+    fprintf(stderr, "                        relevance judgements, \"query-id<tab>doc-id<tab>score\" per line\n");
+    fprintf(stderr, "  --layers N,N,...      encoder layers to keep, 0 for all (default: 0)\n");
+    fprintf(stderr, "  --dims N,N,...        leading embedding dimensions to keep, renormalized, 0 for all (default: 0)\n");
+    fprintf(stderr, "  -k N,N,...            cutoffs for recall (default: 10,100)\n");
+    fprintf(stderr, "  -t N, --threads N     number of threads to use during computation and search (default: %d)\n", params.n_threads);
+    fprintf(stderr, "  -b N, --batch-size N  sequences per forward (default: %d)\n", params.batch_size);
+    fprintf(stderr, "  -n N, --max-tokens N  truncate texts to this many tokens (default: %d)\n", params.n_max_tokens);
+    fprintf(stderr, "  -c, --cpu             use CPU backend (default: use CUDA if available)\n");
+    fprintf(stderr, "\n");
+}
+
+static std::vector<int32_t> eval_parse_list(const std::string & list) {
+    std::vector<int32_t> values;
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        values.push_back(std::stoi(list.substr(start, end - start)));
+        start = end + 1;
+    }
+    return values;
+}
+
+bool eval_retrieval_params_parse(int argc, char **argv, eval_retrieval_params &params) {
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "-m" || arg == "--model") {
+            params.models.push_back(argv[++i]);
+        } else if (arg == "-q" || arg == "--queries") {
+            params.queries = argv[++i];
+        } else if (arg == "-d" || arg == "--corpus") {
+            params.corpus = argv[++i];
+        } else if (arg == "-r" || arg == "--qrels") {
+            params.qrels = argv[++i];
+        } else if (arg == "--layers") {
+            params.layers = eval_parse_list(argv[++i]);
+        } else if (arg == "--dims") {
+            params.dims = eval_parse_list(argv[++i]);
+        } else if (arg == "-k") {
+            params.recall_k = eval_parse_list(argv[++i]);
+        } else if (arg == "-t" || arg == "--threads") {
+            params.n_threads = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "-b" || arg == "--batch-size") {
+            params.batch_size = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "-n" || arg == "--max-tokens") {
+            params.n_max_tokens = std::max(2, std::stoi(argv[++i]));
+        } else if (arg == "-c" || arg == "--cpu") {
+            params.use_cpu = true;
+        } else if (arg == "-h" || arg == "--help") {
+            eval_retrieval_print_usage(argv, params);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            eval_retrieval_print_usage(argv, params);
+            exit(0);
+        }
+    }
+
+    if (params.models.empty()) {
+        params.models.push_back("models/all-MiniLM-L6-v2/ggml-model-q4_0.bin");
+    }
+    if (params.queries == nullptr || params.corpus == nullptr || params.qrels == nullptr) {
+        fprintf(stderr, "error: queries, corpus and qrels are all required\n");
+        eval_retrieval_print_usage(argv, params);
+        return false;
+    }
+    if (params.layers.empty() || params.dims.empty() || params.recall_k.empty()) {
+        fprintf(stderr, "error: every sweep needs at least one value\n");
+        return false;
+    }
+
+    return true;
+}
+
+//
+// data
+//
+
+struct eval_texts {
+    std::vector<std::string> ids;
+    std::string buf;             // all texts packed, as bert_encode_batch_buf_c wants them
+    std::vector<int64_t> offsets; // text i is buf[offsets[i]:offsets[i + 1]]
+};
+
+// "id<tab>text" per line, lines without a tab are skipped
+static bool eval_read_texts(const char * fname, eval_texts & texts) {
+    std::ifstream fin(fname);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+
+    texts.offsets.push_back(0);
+    std::string line;
+    while (std::getline(fin, line)) {
+        const size_t tab = line.find('\t');
+        if (tab == std::string::npos) {
+            continue;
+        }
+        texts.ids.push_back(line.substr(0, tab));
+        texts.buf.append(line, tab + 1, std::string::npos);
+        texts.offsets.push_back(texts.buf.size());
+    }
+    return true;
+}
+
+// query -> doc -> graded relevance, only positive judgements are kept
+typedef std::map<std::string, std::map<std::string, int32_t>> eval_qrels;
+
+static bool eval_read_qrels(const char * fname, eval_qrels & qrels) {
+    std::ifstream fin(fname);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(fin, line)) {
+        const size_t t0 = line.find('\t');
+        const size_t t1 = t0 == std::string::npos ? t0 : line.find('\t', t0 + 1);
+        if (t1 == std::string::npos) {
+            continue;
+        }
+        // the beir header line has no number in the score column
+        char * end = nullptr;
+        const long score = strtol(line.c_str() + t1 + 1, &end, 10);
+        if (end == line.c_str() + t1 + 1 || score <= 0) {
+            continue;
+        }
+        qrels[line.substr(0, t0)][line.substr(t0 + 1, t1 - t0 - 1)] = score;
+    }
+    return true;
+}
+
+//
+// embedding
+//
+
+// embed every text, longest first so batches pad little, returns the time taken in us
+static int64_t eval_embed(bert_ctx * ctx, const eval_texts & texts, std::vector<float> & embd, int32_t n_threads) {
+    const int32_t n_embd = bert_n_embd(ctx);
+    const int32_t n = texts.ids.size();
+
+    std::vector<int32_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int32_t a, int32_t b) {
+        return texts.offsets[a + 1] - texts.offsets[a] > texts.offsets[b + 1] - texts.offsets[b];
+    });
+
+    std::string buf;
+    std::vector<int64_t> offsets = {0};
+    for (int32_t i : order) {
+        buf.append(texts.buf, texts.offsets[i], texts.offsets[i + 1] - texts.offsets[i]);
+        offsets.push_back(buf.size());
+    }
+
+    std::vector<float> sorted((size_t) n * n_embd);
+    const int64_t t_start_us = ggml_time_us();
+    bert_encode_batch_buf_c(ctx, buf.data(), offsets.data(), n, sorted.data(), n_threads);
+    const int64_t t_us = ggml_time_us() - t_start_us;
+
+    embd.resize((size_t) n * n_embd);
+    for (int32_t k = 0; k < n; k++) {
+        std::copy_n(sorted.data() + (size_t) k * n_embd, n_embd, embd.data() + (size_t) order[k] * n_embd);
+    }
+    return t_us;
+}
+
+// keep the leading dim components of each row and scale them back to unit length
+static std::vector<float> eval_truncate(const std::vector<float> & embd, int32_t n_embd, int32_t dim) {
+    const size_t n = embd.size() / n_embd;
+    std::vector<float> out(n * dim);
+    for (size_t i = 0; i < n; i++) {
+        const float * src = embd.data() + i * n_embd;
+        float * dst = out.data() + i * dim;
+        double norm = 0.0;
+        for (int32_t j = 0; j < dim; j++) {
+            norm += (double) src[j] * src[j];
+        }
+        const float scale = norm > 0.0 ? 1.0 / std::sqrt(norm) : 0.0f;
+        for (int32_t j = 0; j < dim; j++) {
+            dst[j] = src[j] * scale;
+        }
+    }
+    return out;
+}
+
+//
+// exact search and metrics
+//
+
+struct eval_scores {
+    double ndcg10 = 0.0;
+    std::vector<double> recall; // one per cutoff
+    int32_t n_judged = 0;       // queries searched, those with at least one relevant document
+    int64_t search_us = 0;
+};
+
+static eval_scores eval_search(
+        const eval_texts & queries, const std::vector<float> & q_embd,
+        const eval_texts & corpus, const std::vector<float> & d_embd,
+        const eval_qrels & qrels, int32_t dim, const std::vector<int32_t> & recall_k, int32_t n_threads) {
+    const int32_t n_queries = queries.ids.size();
+    const int32_t n_docs = corpus.ids.size();
+    const int32_t top_k = std::min(n_docs, std::max(10, *std::max_element(recall_k.begin(), recall_k.end())));
+
+    // brute force inner products, the embeddings are unit length so this ranks by cosine
+    std::vector<std::vector<int32_t>> ranked(n_queries);
+    const int64_t t_start_us = ggml_time_us();
+    auto worker = [&](int32_t t) {
+        std::vector<std::pair<float, int32_t>> scores(n_docs);
+        for (int32_t q = t; q < n_queries; q += n_threads) {
+            if (qrels.count(queries.ids[q]) == 0) {
+                continue;
+            }
+            const float * qv = q_embd.data() + (size_t) q * dim;
+            for (int32_t d = 0; d < n_docs; d++) {
+                const float * dv = d_embd.data() + (size_t) d * dim;
+                float dot = 0.0f;
+                for (int32_t j = 0; j < dim; j++) {
+                    dot += qv[j] * dv[j];
+                }
+                scores[d] = {-dot, d};
+            }
+            std::partial_sort(scores.begin(), scores.begin() + top_k, scores.end());
+            for (int32_t k = 0; k < top_k; k++) {
+                ranked[q].push_back(scores[k].second);
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int32_t t = 1; t < n_threads; t++) {
+        workers.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    eval_scores res;
+    res.search_us = ggml_time_us() - t_start_us;
+    res.recall.resize(recall_k.size());
+
+    // averaged over the queries that have at least one relevant document, like pytrec_eval
+    for (int32_t q = 0; q < n_queries; q++) {
+        auto it = qrels.find(queries.ids[q]);
+        if (it == qrels.end()) {
+            continue;
+        }
+        const auto & rel = it->second;
+        res.n_judged++;
+
+        double dcg = 0.0;
+        for (int32_t k = 0; k < std::min(10, (int32_t) ranked[q].size()); k++) {
+            auto r = rel.find(corpus.ids[ranked[q][k]]);
+            if (r != rel.end()) {
+                dcg += r->second / std::log2(k + 2.0);
+            }
+        }
+        std::vector<int32_t> ideal;
+        for (const auto & r : rel) {
+            ideal.push_back(r.second);
+        }
+        std::sort(ideal.rbegin(), ideal.rend());
+        double idcg = 0.0;
+        for (int32_t k = 0; k < std::min(10, (int32_t) ideal.size()); k++) {
+            idcg += ideal[k] / std::log2(k + 2.0);
+        }
+        res.ndcg10 += dcg / idcg;
+
+        for (size_t c = 0; c < recall_k.size(); c++) {
+            int32_t n_found = 0;
+            for (int32_t k = 0; k < std::min(recall_k[c], (int32_t) ranked[q].size()); k++) {
+                n_found += rel.count(corpus.ids[ranked[q][k]]) > 0;
+            }
+            res.recall[c] += (double) n_found / rel.size();
+        }
+    }
+
+    if (res.n_judged > 0) {
+        res.ndcg10 /= res.n_judged;
+        for (double & r : res.recall) {
+            r /= res.n_judged;
+        }
+    }
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    eval_retrieval_params params;
+    if (eval_retrieval_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    eval_texts queries;
+    eval_texts corpus;
+    eval_qrels qrels;
+    if (!eval_read_texts(params.queries, queries) || !eval_read_texts(params.corpus, corpus) || !eval_read_qrels(params.qrels, qrels)) {
+        return 1;
+    }
+    if (queries.ids.empty() || corpus.ids.empty() || qrels.empty()) {
+        fprintf(stderr, "%s: no queries, documents or positive judgements were read\n", __func__);
+        return 1;
+    }
+    fprintf(stderr, "%s: %zu queries, %zu documents, %zu judged queries\n\n", __func__, queries.ids.size(), corpus.ids.size(), qrels.size());
+
+    printf("| %-32s | %6s | %5s | %8s |", "model", "layers", "dim", "nDCG@10");
+    for (int32_t k : params.recall_k) {
+        printf(" %10s |", ("recall@" + std::to_string(k)).c_str());
+    }
+    printf(" %8s | %8s | %11s | %9s | %9s |\n", "docs/s", "tokens/s", "search ms/q", "model MB", "index MB");
+    printf("|----------------------------------|--------|-------|----------|");
+    for (size_t i = 0; i < params.recall_k.size(); i++) {
+        printf("------------|");
+    }
+    printf("----------|----------|-------------|-----------|-----------|\n");
+
+    for (const std::string & model : params.models) {
+        for (int32_t n_layer : params.layers) {
+            bert_load_params lparams;
+            lparams.use_cpu = params.use_cpu;
+            lparams.n_layer = n_layer;
+            bert_ctx * ctx = bert_load_from_file_ext(model.c_str(), lparams);
+            if (ctx == nullptr) {
+                fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, model.c_str());
+                return 1;
+            }
+
+            const int32_t n_tokens_max = std::min(params.n_max_tokens, bert_n_max_tokens(ctx));
+            bert_allocate_buffers(ctx, n_tokens_max, params.batch_size);
+
+            const int32_t n_embd = bert_n_embd(ctx);
+            std::vector<float> d_embd;
+            std::vector<float> q_embd;
+            const int64_t t_docs_us = eval_embed(ctx, corpus, d_embd, params.n_threads);
+            eval_embed(ctx, queries, q_embd, params.n_threads);
+
+            // tokens actually embedded, after truncation
+            int64_t n_doc_tokens = 0;
+            for (size_t i = 0; i < corpus.ids.size(); i++) {
+                const bert_string text(corpus.buf.data() + corpus.offsets[i], corpus.offsets[i + 1] - corpus.offsets[i]);
+                n_doc_tokens += bert_tokenize(ctx, text, n_tokens_max).size();
+            }
+
+            bert_memory mem;
+            bert_get_memory(ctx, &mem);
+            const int32_t n_layer_used = ctx->model.hparams.n_layer;
+            bert_free(ctx);
+
+            const double docs_s = std::max<int64_t>(t_docs_us, 1) / 1e6;
+            const size_t slash = model.find_last_of('/');
+            const std::string name = slash == std::string::npos ? model : model.substr(slash + 1);
+            for (int32_t dim : params.dims) {
+                if (dim <= 0 || dim > n_embd) {
+                    dim = n_embd;
+                }
+                const std::vector<float> qt = eval_truncate(q_embd, n_embd, dim);
+                const std::vector<float> dt = eval_truncate(d_embd, n_embd, dim);
+                const eval_scores s = eval_search(queries, qt, corpus, dt, qrels, dim, params.recall_k, params.n_threads);
+
+                printf("| %-32s | %6d | %5d | %8.4f |", name.c_str(), n_layer_used, dim, s.ndcg10);
+                for (double r : s.recall) {
+                    printf(" %10.4f |", r);
+                }
+                printf(" %8.1f | %8.0f | %11.3f | %9.2f | %9.2f |\n",
+                    corpus.ids.size() / docs_s, n_doc_tokens / docs_s, s.search_us / 1000.0 / std::max(s.n_judged, 1),
+                    mem.total_bytes / 1024.0 / 1024.0, corpus.ids.size() * dim * sizeof(float) / 1024.0 / 1024.0);
+                fflush(stdout);
+            }
+        }
+    }
+
+    return 0;
+}
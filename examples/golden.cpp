@@ -0,0 +1,337 @@
+#include "bert.h"
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+struct golden_params
+{
+    int32_t n_threads = 4;
+    const char* model = "models/all-MiniLM-L6-v2/ggml-model-q4_0.bin";
+    const char* generate = nullptr;
+    const char* check = nullptr;
+    float min_cos = 0.0f; // 0 = by weight type
+    float max_abs = 0.0f;
+    bool use_cpu = false;
+};
+
+void golden_print_usage(char **argv, const golden_params &params) {
+    fprintf(stderr, "usage: %s [options] (--generate FNAME | --check FNAME)\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model path (default: %s)\n", params.model);
+    fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
+    fprintf(stderr, "  -c, --cpu             use CPU backend (default: use CUDA if available)\n");
+    fprintf(stderr, "  --generate FNAME      write the embeddings of the built-in inputs as the new reference\n");
+    fprintf(stderr, "  --check FNAME         compare against a reference, exit status 1 if out of tolerance\n");
+    fprintf(stderr, "  --min-cos X           minimum cosine similarity (default: by weight type)\n");
+    fprintf(stderr, "  --max-abs X           maximum absolute difference of any component (default: by weight type)\n");
+    fprintf(stderr, "\n");
+}
+
+bool golden_params_parse(int argc, char **argv, golden_params &params) {
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "-m" || arg == "--model") {
+            params.model = argv[++i];
+        } else if (arg == "-t" || arg == "--threads") {
+            params.n_threads = std::stoi(argv[++i]);
+        } else if (arg == "-c" || arg == "--cpu") {
+            params.use_cpu = true;
+        } else if (arg == "--generate") {
+            params.generate = argv[++i];
+        } else if (arg == "--check") {
+            params.check = argv[++i];
+        } else if (arg == "--min-cos") {
+            params.min_cos = std::stof(argv[++i]);
+        } else if (arg == "--max-abs") {
+            params.max_abs = std::stof(argv[++i]);
+        } else if (arg == "-h" || arg == "--help") {
+            golden_print_usage(argv, params);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            golden_print_usage(argv, params);
+            exit(0);
+        }
+    }
+
+    if ((params.generate == nullptr) == (params.check == nullptr)) {
+        fprintf(stderr, "error: give exactly one of --generate and --check\n");
+        golden_print_usage(argv, params);
+        return false;
+    }
+
+    return true;
+}
+
+//
+// inputs, never reorder or edit these without regenerating every reference
+//
+
+struct golden_input {
+    const char * name;
+    std::string text;
+};
+
+static const char * golden_paragraph =
+    "The committee met on Tuesday to review the proposal for the new library wing. "
+    "After a long discussion about costs, parking and the timeline for construction, "
+    "members agreed to ask the architect for a revised plan that keeps the reading room "
+    "open during the work, and to put the question to a public vote in the spring.";
+
+static std::vector<golden_input> golden_inputs(int32_t n_max_tokens) {
+    // long enough to be truncated at the model's maximum length
+    std::string long_text;
+    while ((int32_t) long_text.size() < 8 * n_max_tokens) {
+        long_text += golden_paragraph;
+        long_text += " ";
+    }
+
+    return {
+        {"empty",      ""},
+        {"word",       "hello"},
+        {"short",      "The quick brown fox jumps over the lazy dog."},
+        {"punct",      "Wait... what?! (really) -- \"yes\", she said; 100% sure: a/b & c @ d #e $5.00"},
+        {"numbers",    "Error 0x1F: file 'data_v2.json' not found at /usr/local/share (line 42), retry in 3.5s"},
+        {"whitespace", "  leading\tand   trailing spaces \n"},
+        {"case",       "SHOUTING Words And MiXeD cAsE"},
+        {"accents",    "Café naïve résumé — Ångström façade, Zürich and São Paulo."},
+        {"chinese",    "今天天气很好，我们去公园散步吧。"},
+        {"japanese",   "東京は日本の首都です。ひらがなとカタカナも使います。"},
+        {"korean",     "안녕하세요, 만나서 반갑습니다."},
+        {"cyrillic",   "Привет, как дела? Всё хорошо, спасибо."},
+        {"arabic",     "مرحبا بالعالم، كيف حالك اليوم؟"},
+        {"emoji",      "I love pizza 🍕🍕 and coffee ☕ on Sundays!"},
+        {"mixed",      "The Tokyo office (東京) opens at 9:00 — bring your ID card 🪪."},
+        {"paragraph",  golden_paragraph},
+        {"long",       long_text},
+    };
+}
+
+//
+// tolerances
+//
+
+struct golden_tolerance {
+    const char * type;
+    float min_cos;
+    float max_abs;
+};
+
+// embeddings are l2 normalized, so max_abs is relative to unit length. quantized types get
+// room for their own rounding, so one reference made with f32 weights can check them all
+static const golden_tolerance golden_tolerances[] = {
+    { "f32",  0.99999f, 2e-4f },
+    { "f16",  0.9999f,  1e-3f },
+    { "q8_0", 0.999f,   5e-3f },
+    { "q5_1", 0.995f,   2e-2f },
+    { "q5_0", 0.995f,   2e-2f },
+    { "q4_1", 0.99f,    4e-2f },
+    { "q4_0", 0.99f,    4e-2f },
+};
+
+// the type holding most of the matrix weights, norms and biases are always f32
+static std::string golden_weight_type(bert_ctx * ctx) {
+    bert_memory mem;
+    bert_get_memory(ctx, &mem);
+
+    std::string best = "f32";
+    int64_t best_bytes = 0;
+    for (const auto & it : mem.weights_by_type) {
+        if (it.first != "f32" && it.second > best_bytes) {
+            best = it.first;
+            best_bytes = it.second;
+        }
+    }
+    return best;
+}
+
+//
+// reference files: a header line "<type> <n_inputs> <n_embd>", then one line of
+// n_embd floats per input, in the order of golden_inputs
+//
+
+static bool golden_write(const char * fname, const std::string & type, const std::vector<float> & embd, int32_t n_inputs, int32_t n_embd) {
+    FILE * fout = fopen(fname, "w");
+    if (fout == nullptr) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
+        return false;
+    }
+
+    fprintf(fout, "%s %d %d\n", type.c_str(), n_inputs, n_embd);
+    for (int32_t i = 0; i < n_inputs; i++) {
+        for (int32_t j = 0; j < n_embd; j++) {
+            fprintf(fout, j == 0 ? "%.9g" : " %.9g", embd[(size_t) i * n_embd + j]);
+        }
+        fprintf(fout, "\n");
+    }
+
+    const bool ok = ferror(fout) == 0;
+    fclose(fout);
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname);
+    }
+    return ok;
+}
+
+static bool golden_read(const char * fname, std::string & type, std::vector<float> & embd, int32_t n_inputs, int32_t n_embd) {
+    std::ifstream fin(fname);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+
+    int32_t file_inputs = 0;
+    int32_t file_embd = 0;
+    if (!(fin >> type >> file_inputs >> file_embd)) {
+        fprintf(stderr, "%s: '%s' has no header\n", __func__, fname);
+        return false;
+    }
+    if (file_inputs != n_inputs || file_embd != n_embd) {
+        fprintf(stderr, "%s: '%s' holds %d x %d embeddings, expected %d x %d (other model or input set?)\n",
+            __func__, fname, file_inputs, file_embd, n_inputs, n_embd);
+        return false;
+    }
+
+    embd.resize((size_t) n_inputs * n_embd);
+    for (float & x : embd) {
+        if (!(fin >> x)) {
+            fprintf(stderr, "%s: '%s' is truncated\n", __func__, fname);
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// comparison
+//
+
+struct golden_diff {
+    float cos = 1.0f;
+    float max_abs = 0.0f;
+    bool finite = true;
+};
+
+static golden_diff golden_compare(const float * a, const float * b, int32_t n) {
+    golden_diff d;
+    double dot = 0.0, na = 0.0, nb = 0.0;
+    for (int32_t i = 0; i < n; i++) {
+        if (!std::isfinite(a[i])) {
+            d.finite = false;
+        }
+        dot += (double) a[i] * b[i];
+        na += (double) a[i] * a[i];
+        nb += (double) b[i] * b[i];
+        d.max_abs = std::max(d.max_abs, std::fabs(a[i] - b[i]));
+    }
+    d.cos = (na > 0.0 && nb > 0.0) ? dot / std::sqrt(na * nb) : (na == nb ? 1.0f : 0.0f);
+    return d;
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    golden_params params;
+    if (golden_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    bert_ctx * ctx = bert_load_from_file(params.model, params.use_cpu);
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model);
+        return 1;
+    }
+
+    const int32_t n_max_tokens = bert_n_max_tokens(ctx);
+    const int32_t n_embd = bert_n_embd(ctx);
+    const std::vector<golden_input> inputs = golden_inputs(n_max_tokens);
+    const int32_t n_inputs = inputs.size();
+    const std::string type = golden_weight_type(ctx);
+
+    // one batch holds every input, so short texts sit next to a truncated one and are mostly padding
+    bert_allocate_buffers(ctx, n_max_tokens, n_inputs);
+
+    // each input on its own
+    std::vector<float> single((size_t) n_inputs * n_embd);
+    for (int32_t i = 0; i < n_inputs; i++) {
+        bert_encode(ctx, inputs[i].text, single.data() + (size_t) i * n_embd, params.n_threads);
+    }
+
+    if (params.generate) {
+        const bool ok = golden_write(params.generate, type, single, n_inputs, n_embd);
+        if (ok) {
+            fprintf(stderr, "%s: wrote %d %s reference embeddings to '%s'\n", __func__, n_inputs, type.c_str(), params.generate);
+        }
+        bert_free(ctx);
+        return ok ? 0 : 1;
+    }
+
+    std::string ref_type;
+    std::vector<float> ref;
+    if (!golden_read(params.check, ref_type, ref, n_inputs, n_embd)) {
+        bert_free(ctx);
+        return 1;
+    }
+
+    // all inputs in one padded batch
+    std::vector<float> batched((size_t) n_inputs * n_embd);
+    {
+        bert_strings texts;
+        for (const auto & input : inputs) {
+            texts.push_back(input.text);
+        }
+        bert_encode_batch(ctx, texts, batched.data(), params.n_threads);
+    }
+
+    golden_tolerance tol = { type.c_str(), params.min_cos, params.max_abs };
+    for (const auto & t : golden_tolerances) {
+        if (type == t.type) {
+            tol.min_cos = params.min_cos > 0.0f ? params.min_cos : t.min_cos;
+            tol.max_abs = params.max_abs > 0.0f ? params.max_abs : t.max_abs;
+        }
+    }
+    if (tol.min_cos <= 0.0f || tol.max_abs <= 0.0f) {
+        fprintf(stderr, "%s: no default tolerance for weight type %s, pass --min-cos and --max-abs\n", __func__, type.c_str());
+        bert_free(ctx);
+        return 1;
+    }
+
+    fprintf(stderr, "%s: %s weights against a %s reference, min cos %g, max abs %g\n\n",
+        __func__, type.c_str(), ref_type.c_str(), tol.min_cos, tol.max_abs);
+
+    int32_t n_fail = 0;
+    printf("| %-10s | %6s | %10s | %10s | %10s | %10s | %s\n", "input", "tokens", "cos", "max abs", "batch cos", "batch abs", "");
+    printf("|------------|--------|------------|------------|------------|------------|\n");
+    for (int32_t i = 0; i < n_inputs; i++) {
+        const float * r = ref.data() + (size_t) i * n_embd;
+        const golden_diff ds = golden_compare(single.data() + (size_t) i * n_embd, r, n_embd);
+        const golden_diff db = golden_compare(batched.data() + (size_t) i * n_embd, r, n_embd);
+
+        bool ok = true;
+        for (const golden_diff & d : {ds, db}) {
+            ok = ok && d.finite && d.cos >= tol.min_cos && d.max_abs <= tol.max_abs;
+        }
+        n_fail += !ok;
+
+        const size_t n_tokens = bert_tokenize(ctx, inputs[i].text, n_max_tokens).size();
+        printf("| %-10s | %6zu | %10.7f | %10.2e | %10.7f | %10.2e | %s\n",
+            inputs[i].name, n_tokens, ds.cos, ds.max_abs, db.cos, db.max_abs, ok ? "" : "FAIL");
+    }
+
+    printf("\n%s: %d of %d inputs out of tolerance\n", n_fail ? "FAIL" : "OK", n_fail, n_inputs);
+
+    bert_free(ctx);
+
+    return n_fail ? 1 : 0;
+}
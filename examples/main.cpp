@@ -130,5 +130,23 @@ int main(int argc, char ** argv) {
         fprintf(stderr, "%s:    total time = %8.2f ms\n", __func__, (t_main_end_us - t_main_start_us)/1000.0f);
     }
 
+    // report memory
+    {
+        bert_memory mem;
+        bert_get_memory(bctx, &mem);
+
+        std::string types;
+        for (const auto & it : mem.weights_by_type) {
+            types += (types.empty() ? "" : ", ") + it.first + " " + std::to_string(it.second / 1024 / 1024) + " MB";
+        }
+
+        fprintf(stderr, "\n");
+        fprintf(stderr, "%s:       weights = %8.2f MB (%s%s)\n", __func__, mem.weights_bytes/1024.0/1024.0, types.c_str(), mem.weights_mapped ? ", mapped" : "");
+        fprintf(stderr, "%s:         vocab = %8.2f MB\n", __func__, mem.vocab_bytes/1024.0/1024.0);
+        fprintf(stderr, "%s:       compute = %8.2f MB / %.2f MB used\n", __func__, mem.compute_bytes/1024.0/1024.0, mem.compute_peak_bytes/1024.0/1024.0);
+        fprintf(stderr, "%s:  meta+staging = %8.2f MB\n", __func__, (mem.tensor_meta_bytes + mem.graph_meta_bytes + mem.staging_bytes)/1024.0/1024.0);
+        fprintf(stderr, "%s:  total memory = %8.2f MB\n", __func__, mem.total_bytes/1024.0/1024.0);
+    }
+
     return 0;
 }
@@ -0,0 +1,247 @@
+#ifndef SERVER_SHM_H
+#define SERVER_SHM_H
+
+// shared memory transport for co-located clients (linux only)
+//
+// the segment is a header followed by n_slots fixed size slots. a client
+// claims a FREE slot, writes text or token ids into its payload, marks it
+// READY and rings the doorbell. the server batches READY slots across
+// clients and writes the embedding back into the same payload before
+// marking the slot DONE. both sides sleep on futexes in the shared pages.
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define BERT_SHM_MAGIC 0x314d485354524542ull // "BERTSHM1"
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared memory atomics must be lock free");
+
+enum bert_shm_state : uint32_t {
+    BERT_SHM_FREE = 0,
+    BERT_SHM_CLAIMED,  // a client is writing the payload
+    BERT_SHM_READY,    // waiting for the server
+    BERT_SHM_BUSY,     // queued for or inside a batch
+    BERT_SHM_DONE,     // result available to the client
+};
+
+enum bert_shm_kind : uint32_t {
+    BERT_SHM_KIND_TEXT = 0,
+    BERT_SHM_KIND_TOKENS = 1,
+};
+
+// or'ed into the slot kind to queue it as bulk work instead of interactive
+#define BERT_SHM_FLAG_BULK 0x100
+
+struct alignas(64) bert_shm_header {
+    std::atomic<uint64_t> magic;
+    uint32_t n_slots;
+    uint32_t slot_size;             // payload bytes per slot
+    uint32_t n_embd;
+    uint32_t n_max_tokens;
+    std::atomic<uint32_t> head;     // where producers start looking for a free slot
+    std::atomic<uint32_t> doorbell; // bumped on every submission, the server sleeps on it
+};
+
+struct alignas(64) bert_shm_slot {
+    std::atomic<uint32_t> state;
+    uint32_t kind;   // bert_shm_kind of the input
+    uint32_t len;    // input: bytes of text or number of tokens, output: number of floats
+    uint32_t status; // 0 on success
+};
+
+static inline size_t bert_shm_slot_stride(uint32_t slot_size) {
+    return (sizeof(bert_shm_slot) + slot_size + 63) & ~(size_t) 63;
+}
+
+static inline size_t bert_shm_size(uint32_t n_slots, uint32_t slot_size) {
+    return sizeof(bert_shm_header) + n_slots * bert_shm_slot_stride(slot_size);
+}
+
+static inline bert_shm_slot * bert_shm_get_slot(bert_shm_header * header, uint32_t slot_size, uint32_t i) {
+    uint8_t * base = reinterpret_cast<uint8_t *>(header) + sizeof(bert_shm_header);
+    return reinterpret_cast<bert_shm_slot *>(base + i * bert_shm_slot_stride(slot_size));
+}
+
+static inline uint8_t * bert_shm_payload(bert_shm_slot * slot) {
+    return reinterpret_cast<uint8_t *>(slot + 1);
+}
+
+//
+// futex helpers, shared (not private) since the words live in a shared mapping
+//
+
+static inline void bert_shm_futex_wait(std::atomic<uint32_t> * addr, uint32_t expected, int64_t timeout_us) {
+    struct timespec ts;
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT, expected, timeout_us < 0 ? nullptr : &ts, nullptr, 0);
+}
+
+static inline void bert_shm_futex_wake(std::atomic<uint32_t> * addr, int n) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE, n, nullptr, nullptr, 0);
+}
+
+//
+// server side
+//
+
+// the server's own copy of the ring geometry. clients can write to the shared
+// header, so the server never reads these fields back from it
+struct bert_shm_ring {
+    bert_shm_header * header = nullptr;
+    uint32_t n_slots = 0;
+    uint32_t slot_size = 0;
+    uint32_t n_embd = 0;
+    uint32_t n_max_tokens = 0;
+};
+
+// ring.header is null on failure
+static inline bert_shm_ring bert_shm_create(const char * name, uint32_t n_slots, uint32_t slot_size, uint32_t n_embd, uint32_t n_max_tokens) {
+    bert_shm_ring ring;
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        return ring;
+    }
+
+    const size_t size = bert_shm_size(n_slots, slot_size);
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return ring;
+    }
+
+    void * addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        shm_unlink(name);
+        return ring;
+    }
+
+    // fresh pages are zeroed, so every slot starts out FREE
+    bert_shm_header * header = static_cast<bert_shm_header *>(addr);
+    header->n_slots = n_slots;
+    header->slot_size = slot_size;
+    header->n_embd = n_embd;
+    header->n_max_tokens = n_max_tokens;
+
+    // publish last so clients never see a half initialized header
+    header->magic.store(BERT_SHM_MAGIC, std::memory_order_release);
+
+    ring.header = header;
+    ring.n_slots = n_slots;
+    ring.slot_size = slot_size;
+    ring.n_embd = n_embd;
+    ring.n_max_tokens = n_max_tokens;
+    return ring;
+}
+
+static inline void bert_shm_destroy(const char * name, const bert_shm_ring & ring) {
+    munmap(ring.header, bert_shm_size(ring.n_slots, ring.slot_size));
+    shm_unlink(name);
+}
+
+// mark a slot finished and wake its owner
+static inline void bert_shm_complete(bert_shm_slot * slot, uint32_t status, uint32_t len) {
+    slot->status = status;
+    slot->len = len;
+    slot->state.store(BERT_SHM_DONE, std::memory_order_release);
+    bert_shm_futex_wake(&slot->state, 1);
+}
+
+//
+// client side
+//
+
+static inline bert_shm_header * bert_shm_open(const char * name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(bert_shm_header)) {
+        close(fd);
+        return nullptr;
+    }
+
+    void * addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+
+    bert_shm_header * header = static_cast<bert_shm_header *>(addr);
+    if (header->magic.load(std::memory_order_acquire) != BERT_SHM_MAGIC ||
+        bert_shm_size(header->n_slots, header->slot_size) > (size_t) st.st_size) {
+        munmap(addr, st.st_size);
+        return nullptr;
+    }
+
+    return header;
+}
+
+static inline void bert_shm_close(bert_shm_header * header) {
+    munmap(header, bert_shm_size(header->n_slots, header->slot_size));
+}
+
+// embed one input through the server, blocking until the result is back
+// out must hold header->n_embd floats
+static inline bool bert_shm_embed(bert_shm_header * header, bert_shm_kind kind, const void * data, uint32_t n_bytes, float * out, bool bulk = false) {
+    const uint32_t slot_size = header->slot_size;
+    if (n_bytes > slot_size) {
+        return false;
+    }
+
+    // claim any free slot, starting where the last producer left off
+    const uint32_t n_slots = header->n_slots;
+    bert_shm_slot * slot = nullptr;
+    while (slot == nullptr) {
+        const uint32_t start = header->head.fetch_add(1, std::memory_order_relaxed);
+        for (uint32_t k = 0; k < n_slots; k++) {
+            bert_shm_slot * cur = bert_shm_get_slot(header, slot_size, (start + k) % n_slots);
+            uint32_t expected = BERT_SHM_FREE;
+            if (cur->state.compare_exchange_strong(expected, BERT_SHM_CLAIMED, std::memory_order_acquire)) {
+                slot = cur;
+                break;
+            }
+        }
+        if (slot == nullptr) {
+            sched_yield();
+        }
+    }
+
+    // fill in the request and ring the doorbell
+    slot->kind = bulk ? (kind | BERT_SHM_FLAG_BULK) : kind;
+    slot->len = kind == BERT_SHM_KIND_TOKENS ? n_bytes / sizeof(int32_t) : n_bytes;
+    memcpy(bert_shm_payload(slot), data, n_bytes);
+    slot->state.store(BERT_SHM_READY, std::memory_order_release);
+    header->doorbell.fetch_add(1, std::memory_order_release);
+    bert_shm_futex_wake(&header->doorbell, 1);
+
+    // sleep until the server is done with it
+    uint32_t state;
+    while ((state = slot->state.load(std::memory_order_acquire)) != BERT_SHM_DONE) {
+        bert_shm_futex_wait(&slot->state, state, -1);
+    }
+
+    const bool ok = slot->status == 0 && slot->len == header->n_embd;
+    if (ok) {
+        memcpy(out, bert_shm_payload(slot), header->n_embd * sizeof(float));
+    }
+    slot->state.store(BERT_SHM_FREE, std::memory_order_release);
+
+    return ok;
+}
+
+#endif // SERVER_SHM_H
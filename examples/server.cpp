@@ -0,0 +1,1381 @@
+#include "bert.h"
+#include "ggml.h"
+
+#ifdef __linux__
+#include "server-shm.h"
+#endif
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//
+// binary protocol (host byte order)
+//
+// request:  "BERT" u32 kind u32 n_items, then per item u32 len + payload
+//           kind 0: payload is len bytes of utf-8 text
+//           kind 1: payload is len int32 token ids
+//           kind | 0x100 queues the request as bulk work instead of interactive
+//           a request larger than SERVER_MAX_BODY in total closes the connection
+// response: u32 status (a bert_status, 0 = ok) u32 n_items u32 n_embd, then n_items * n_embd f32
+//
+
+#define SERVER_MAGIC "BERT"
+#define SERVER_KIND_TEXT 0
+#define SERVER_KIND_TOKENS 1
+#define SERVER_FLAG_BULK 0x100
+
+#define SERVER_MAX_BODY (64 * 1024 * 1024)
+
+// registry name of the model given with -m, used by the binary and shm transports
+#define SERVER_DEFAULT_MODEL "default"
+
+struct server_params
+{
+    int32_t n_threads = 6;
+    const char* model = "models/all-MiniLM-L6-v2/ggml-model-q4_0.bin";
+    const char* socket_path = nullptr;
+    const char* shm_name = nullptr;
+    int32_t shm_slots = 64;
+    int32_t shm_slot_bytes = 16384;
+    int32_t port = 8080;
+    int32_t batch_size = 32;
+    int32_t max_batch_tokens = 4096;
+    int32_t max_delay_us = 2000;
+    int32_t interactive_max_batch_tokens = 512;
+    int32_t interactive_max_delay_us = 0;
+    int32_t max_queue_delay_us = 0;
+    int32_t memory_budget_mb = 0;
+    std::vector<std::pair<std::string, std::string>> models; // extra name=path pairs
+    std::vector<int32_t> warmup_lens;
+    bool warmup = true;
+    bool use_mmap = false;
+    bool use_mlock = false;
+    bool stream_layers = false;
+    bool use_cpu = false;
+    const char* trace = nullptr;
+    bool trace_ops = false;
+};
+
+void server_print_usage(char **argv, const server_params &params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        default model path (default: %s)\n", params.model);
+    fprintf(stderr, "  --register NAME=FNAME also serve the model at FNAME under NAME, may be repeated\n");
+    fprintf(stderr, "  --memory-budget-mb N  evict least recently used models beyond this many MB, 0 for no limit (default: %d)\n", params.memory_budget_mb);
+    fprintf(stderr, "  -s PATH, --socket PATH\n");
+    fprintf(stderr, "                        also listen on a unix domain socket\n");
+    fprintf(stderr, "  --port PORT           localhost HTTP port, 0 to disable (default: %d)\n", params.port);
+#ifdef __linux__
+    fprintf(stderr, "  --shm NAME            also serve a shared memory ring named NAME (e.g. /bert)\n");
+    fprintf(stderr, "  --shm-slots N         number of shared memory slots (default: %d)\n", params.shm_slots);
+    fprintf(stderr, "  --shm-slot-bytes N    input bytes per shared memory slot (default: %d)\n", params.shm_slot_bytes);
+#endif
+    fprintf(stderr, "  -b BATCH_SIZE, --batch-size BATCH_SIZE\n");
+    fprintf(stderr, "                        maximum sequences per forward (default: %d)\n", params.batch_size);
+    fprintf(stderr, "  --max-batch-tokens N  maximum padded tokens per forward (default: %d)\n", params.max_batch_tokens);
+    fprintf(stderr, "  --max-delay-us N      maximum time a request waits for a batch to fill (default: %d)\n", params.max_delay_us);
+    fprintf(stderr, "  --interactive-max-batch-tokens N\n");
+    fprintf(stderr, "                        padded token budget of batches led by interactive requests (default: %d)\n", params.interactive_max_batch_tokens);
+    fprintf(stderr, "  --interactive-max-delay-us N\n");
+    fprintf(stderr, "                        maximum time an interactive request waits for a batch to fill (default: %d)\n", params.interactive_max_delay_us);
+    fprintf(stderr, "  --max-queue-delay-us N\n");
+    fprintf(stderr, "                        reject requests whose estimated queueing delay exceeds this, 0 to disable (default: %d)\n", params.max_queue_delay_us);
+    fprintf(stderr, "  --warmup-lens L1,L2,...\n");
+    fprintf(stderr, "                        sequence lengths to warm up before serving (default: the longest)\n");
+    fprintf(stderr, "  --no-warmup           serve models without warming them up first\n");
+    fprintf(stderr, "  --mmap                map model weights from the file instead of reading them (CPU only)\n");
+    fprintf(stderr, "  --mlock               pin weights and compute buffers in RAM, as far as RLIMIT_MEMLOCK allows\n");
+    fprintf(stderr, "  --stream-layers       low memory mode, keep only the weights of the layers being computed resident (CPU only)\n");
+    fprintf(stderr, "  --trace FNAME         record a chrome trace of the whole run, written to FNAME on shutdown\n");
+    fprintf(stderr, "  --trace-ops           also trace every graph node, nodes then run one at a time\n");
+    fprintf(stderr, "  -c, --cpu             use CPU backend (default: use CUDA if available)\n");
+    fprintf(stderr, "\n");
+}
+
+bool server_params_parse(int argc, char **argv, server_params &params) {
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "-t" || arg == "--threads") {
+            params.n_threads = std::stoi(argv[++i]);
+        } else if (arg == "-m" || arg == "--model") {
+            params.model = argv[++i];
+        } else if (arg == "--register") {
+            std::string spec = argv[++i];
+            const size_t eq = spec.find('=');
+            if (eq == std::string::npos || eq == 0 || eq + 1 == spec.size()) {
+                fprintf(stderr, "error: --register expects NAME=FNAME, got: %s\n", spec.c_str());
+                server_print_usage(argv, params);
+                exit(0);
+            }
+            params.models.emplace_back(spec.substr(0, eq), spec.substr(eq + 1));
+        } else if (arg == "--memory-budget-mb") {
+            params.memory_budget_mb = std::stoi(argv[++i]);
+        } else if (arg == "-s" || arg == "--socket") {
+            params.socket_path = argv[++i];
+        } else if (arg == "--shm") {
+            params.shm_name = argv[++i];
+        } else if (arg == "--shm-slots") {
+            params.shm_slots = std::stoi(argv[++i]);
+        } else if (arg == "--shm-slot-bytes") {
+            params.shm_slot_bytes = std::stoi(argv[++i]);
+        } else if (arg == "--port") {
+            params.port = std::stoi(argv[++i]);
+        } else if (arg == "-b" || arg == "--batch-size") {
+            params.batch_size = std::stoi(argv[++i]);
+        } else if (arg == "--max-batch-tokens") {
+            params.max_batch_tokens = std::stoi(argv[++i]);
+        } else if (arg == "--max-delay-us") {
+            params.max_delay_us = std::stoi(argv[++i]);
+        } else if (arg == "--interactive-max-batch-tokens") {
+            params.interactive_max_batch_tokens = std::stoi(argv[++i]);
+        } else if (arg == "--interactive-max-delay-us") {
+            params.interactive_max_delay_us = std::stoi(argv[++i]);
+        } else if (arg == "--max-queue-delay-us") {
+            params.max_queue_delay_us = std::stoi(argv[++i]);
+        } else if (arg == "--warmup-lens") {
+            std::string list = argv[++i];
+            size_t start = 0;
+            while (start < list.size()) {
+                size_t end = list.find(',', start);
+                if (end == std::string::npos) {
+                    end = list.size();
+                }
+                params.warmup_lens.push_back(std::stoi(list.substr(start, end - start)));
+                start = end + 1;
+            }
+        } else if (arg == "--no-warmup") {
+            params.warmup = false;
+        } else if (arg == "--mmap") {
+            params.use_mmap = true;
+        } else if (arg == "--mlock") {
+            params.use_mlock = true;
+        } else if (arg == "--stream-layers") {
+            params.stream_layers = true;
+        } else if (arg == "--trace") {
+            params.trace = argv[++i];
+        } else if (arg == "--trace-ops") {
+            params.trace_ops = true;
+        } else if (arg == "-c" || arg == "--cpu") {
+            params.use_cpu = true;
+        } else if (arg == "-h" || arg == "--help") {
+            server_print_usage(argv, params);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            server_print_usage(argv, params);
+            exit(0);
+        }
+    }
+
+    return true;
+}
+
+//
+// embedding through the batcher
+//
+
+// collects the per-sequence callbacks of one client request
+struct server_job {
+    std::mutex mutex;
+    std::condition_variable cond;
+    int32_t n_pending = 0;
+    bert_status status = BERT_STATUS_OK; // first failure wins
+    std::vector<float> embeddings;
+};
+
+// true once the peer has closed its end of the connection
+static bool server_client_gone(int fd) {
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+// submit all sequences and block until every embedding has arrived,
+// the remaining work is cancelled if the client on fd hangs up meanwhile
+static bert_status server_embed(bert_ctx * ctx, int fd, bert_batch & batch, bert_request_params rparams, std::vector<float> & embeddings) {
+    const int32_t n_embd = bert_n_embd(ctx);
+    const int32_t n_input = batch.size();
+
+    auto job = std::make_shared<server_job>();
+    job->embeddings.resize((size_t) n_input * n_embd);
+    rparams.cancel = std::make_shared<bert_cancel_token>();
+
+    for (int32_t i = 0; i < n_input; i++) {
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->n_pending++;
+        }
+        bert_status status = bert_batcher_submit(ctx, std::move(batch[i]), [job, i](bert_status status, const float * embedding, int32_t n_embd) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            if (status == BERT_STATUS_OK) {
+                memcpy(job->embeddings.data() + (size_t) i * n_embd, embedding, n_embd * sizeof(float));
+            } else if (job->status == BERT_STATUS_OK) {
+                job->status = status;
+            }
+            if (--job->n_pending == 0) {
+                job->cond.notify_one();
+            }
+        }, rparams);
+        if (status != BERT_STATUS_OK) {
+            // no point computing the rest of a request that already failed
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->n_pending--;
+            job->status = status;
+            rparams.cancel->cancelled = true;
+            break;
+        }
+    }
+
+    // wait for whatever made it into the queue, even on failure
+    std::unique_lock<std::mutex> lock(job->mutex);
+    while (job->n_pending > 0) {
+        if (job->cond.wait_for(lock, std::chrono::milliseconds(50)) == std::cv_status::timeout && fd >= 0 && server_client_gone(fd)) {
+            rparams.cancel->cancelled = true;
+        }
+    }
+
+    if (job->status == BERT_STATUS_OK) {
+        embeddings = std::move(job->embeddings);
+    }
+    return job->status;
+}
+
+//
+// connection i/o
+//
+
+struct server_conn {
+    int fd;
+    std::string buf; // received but not yet consumed
+
+    bool fill() {
+        char tmp[16384];
+        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n <= 0) {
+            return false;
+        }
+        buf.append(tmp, n);
+        return true;
+    }
+
+    bool peek(size_t n) {
+        while (buf.size() < n) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool read_exact(void * dst, size_t n) {
+        if (!peek(n)) {
+            return false;
+        }
+        memcpy(dst, buf.data(), n);
+        buf.erase(0, n);
+        return true;
+    }
+
+    bool read_line(std::string & line) {
+        size_t pos;
+        while ((pos = buf.find("\r\n")) == std::string::npos) {
+            if (buf.size() > 65536 || !fill()) {
+                return false;
+            }
+        }
+        line = buf.substr(0, pos);
+        buf.erase(0, pos + 2);
+        return true;
+    }
+
+    bool write_all(const void * src, size_t n) {
+        const char * p = (const char *) src;
+        while (n > 0) {
+            ssize_t k = send(fd, p, n, MSG_NOSIGNAL);
+            if (k <= 0) {
+                return false;
+            }
+            p += k;
+            n -= k;
+        }
+        return true;
+    }
+};
+
+//
+// minimal json
+//
+
+struct json_reader {
+    const std::string & s;
+    size_t i = 0;
+
+    json_reader(const std::string & s) : s(s) {}
+
+    void skip_ws() {
+        while (i < s.size() && isspace((unsigned char) s[i])) i++;
+    }
+
+    bool consume(char c) {
+        skip_ws();
+        if (i < s.size() && s[i] == c) {
+            i++;
+            return true;
+        }
+        return false;
+    }
+
+    bool peek(char c) {
+        skip_ws();
+        return i < s.size() && s[i] == c;
+    }
+
+    static void append_utf8(std::string & out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += (char) cp;
+        } else if (cp < 0x800) {
+            out += (char) (0xc0 | (cp >> 6));
+            out += (char) (0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            out += (char) (0xe0 | (cp >> 12));
+            out += (char) (0x80 | ((cp >> 6) & 0x3f));
+            out += (char) (0x80 | (cp & 0x3f));
+        } else {
+            out += (char) (0xf0 | (cp >> 18));
+            out += (char) (0x80 | ((cp >> 12) & 0x3f));
+            out += (char) (0x80 | ((cp >> 6) & 0x3f));
+            out += (char) (0x80 | (cp & 0x3f));
+        }
+    }
+
+    bool hex4(uint32_t & cp) {
+        if (i + 4 > s.size()) return false;
+        cp = 0;
+        for (int k = 0; k < 4; k++) {
+            char c = s[i++];
+            cp <<= 4;
+            if (c >= '0' && c <= '9') cp |= c - '0';
+            else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+            else return false;
+        }
+        return true;
+    }
+
+    bool string(std::string & out) {
+        out.clear();
+        if (!consume('"')) return false;
+        while (i < s.size()) {
+            char c = s[i++];
+            if (c == '"') return true;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (i >= s.size()) return false;
+            c = s[i++];
+            switch (c) {
+                case '"':  out += '"';  break;
+                case '\\': out += '\\'; break;
+                case '/':  out += '/';  break;
+                case 'b':  out += '\b'; break;
+                case 'f':  out += '\f'; break;
+                case 'n':  out += '\n'; break;
+                case 'r':  out += '\r'; break;
+                case 't':  out += '\t'; break;
+                case 'u': {
+                    uint32_t cp;
+                    if (!hex4(cp)) return false;
+                    // combine surrogate pairs, an unpaired half becomes U+FFFD
+                    if (cp >= 0xd800 && cp < 0xdc00) {
+                        const size_t next = i;
+                        uint32_t lo = 0;
+                        if (i + 1 < s.size() && s[i] == '\\' && s[i + 1] == 'u') {
+                            i += 2;
+                            if (!hex4(lo)) return false;
+                        }
+                        if (lo >= 0xdc00 && lo < 0xe000) {
+                            cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                        } else {
+                            // not a low surrogate, parse it again as its own escape
+                            cp = 0xfffd;
+                            i = next;
+                        }
+                    } else if (cp >= 0xdc00 && cp < 0xe000) {
+                        cp = 0xfffd;
+                    }
+                    append_utf8(out, cp);
+                } break;
+                default: return false;
+            }
+        }
+        return false;
+    }
+
+    bool number(double & out) {
+        skip_ws();
+        const char * begin = s.c_str() + i;
+        char * end = nullptr;
+        out = strtod(begin, &end);
+        if (end == begin) return false;
+        i += end - begin;
+        return true;
+    }
+
+    // skip over any value, used for keys we don't know about
+    bool skip() {
+        skip_ws();
+        if (i >= s.size()) return false;
+        std::string tmp;
+        double num;
+        switch (s[i]) {
+            case '"': return string(tmp);
+            case '{': {
+                i++;
+                if (consume('}')) return true;
+                do {
+                    if (!string(tmp) || !consume(':') || !skip()) return false;
+                } while (consume(','));
+                return consume('}');
+            }
+            case '[': {
+                i++;
+                if (consume(']')) return true;
+                do {
+                    if (!skip()) return false;
+                } while (consume(','));
+                return consume(']');
+            }
+            case 't': i += 4; return true;
+            case 'f': i += 5; return true;
+            case 'n': i += 4; return true;
+            default: return number(num);
+        }
+    }
+
+    // iterate object members: call after consume('{'), returns false at the end
+    bool next_key(std::string & key, bool & first, bool & ok) {
+        if (consume('}')) return false;
+        if (!first && !consume(',')) {
+            ok = false;
+            return false;
+        }
+        if (!string(key) || !consume(':')) {
+            ok = false;
+            return false;
+        }
+        first = false;
+        return true;
+    }
+};
+
+// accepts {"input": "text"} or {"input": ["text", ...]}, plus optional
+// "model": name, "priority": "interactive" | "bulk" and "timeout_ms": number
+static bool server_parse_embed_request(const std::string & body, bert_strings & texts, std::string & model, bert_request_params & rparams, std::string & error) {
+    json_reader r(body);
+    if (!r.consume('{')) {
+        error = "expected a json object";
+        return false;
+    }
+
+    bool ok = true;
+    bool first = true;
+    bool found = false;
+    std::string key;
+    while (r.next_key(key, first, ok)) {
+        if (key == "input") {
+            found = true;
+            if (r.peek('[')) {
+                r.consume('[');
+                if (!r.consume(']')) {
+                    do {
+                        std::string text;
+                        if (!r.string(text)) {
+                            error = "input must contain only strings";
+                            return false;
+                        }
+                        texts.push_back(std::move(text));
+                    } while (r.consume(','));
+                    if (!r.consume(']')) {
+                        error = "unterminated input array";
+                        return false;
+                    }
+                }
+            } else {
+                std::string text;
+                if (!r.string(text)) {
+                    error = "input must be a string or an array of strings";
+                    return false;
+                }
+                texts.push_back(std::move(text));
+            }
+        } else if (key == "model") {
+            if (!r.string(model)) {
+                error = "model must be a string";
+                return false;
+            }
+        } else if (key == "priority") {
+            std::string value;
+            if (!r.string(value) || (value != "interactive" && value != "bulk")) {
+                error = "priority must be \"interactive\" or \"bulk\"";
+                return false;
+            }
+            rparams.priority = value == "bulk" ? BERT_PRIORITY_BULK : BERT_PRIORITY_INTERACTIVE;
+        } else if (key == "timeout_ms") {
+            double timeout_ms;
+            if (!r.number(timeout_ms) || timeout_ms <= 0) {
+                error = "timeout_ms must be a positive number";
+                return false;
+            }
+            rparams.deadline_us = ggml_time_us() + (int64_t) (timeout_ms * 1000.0);
+        } else if (!r.skip()) {
+            ok = false;
+            break;
+        }
+    }
+
+    if (!ok) {
+        error = "malformed json";
+        return false;
+    }
+    if (!found) {
+        error = "missing field 'input'";
+        return false;
+    }
+    return true;
+}
+
+// accepts {"path": "model.gguf"} plus optional "model": name (default "default")
+static bool server_parse_reload_request(const std::string & body, std::string & model, std::string & path, std::string & error) {
+    json_reader r(body);
+    if (!r.consume('{')) {
+        error = "expected a json object";
+        return false;
+    }
+
+    bool ok = true;
+    bool first = true;
+    std::string key;
+    while (r.next_key(key, first, ok)) {
+        if (key == "model" || key == "path") {
+            if (!r.string(key == "model" ? model : path)) {
+                error = key + " must be a string";
+                return false;
+            }
+        } else if (!r.skip()) {
+            ok = false;
+            break;
+        }
+    }
+
+    if (!ok) {
+        error = "malformed json";
+        return false;
+    }
+    if (path.empty()) {
+        error = "missing field 'path'";
+        return false;
+    }
+    return true;
+}
+
+static std::string server_format_embeddings(const std::vector<float> & embeddings, int32_t n_input, int32_t n_embd) {
+    std::string out;
+    out.reserve((size_t) n_input * n_embd * 12 + 64);
+    out += "{\"n_embd\":" + std::to_string(n_embd) + ",\"embeddings\":[";
+    char num[32];
+    for (int32_t i = 0; i < n_input; i++) {
+        out += i == 0 ? "[" : ",[";
+        for (int32_t j = 0; j < n_embd; j++) {
+            int len = snprintf(num, sizeof(num), j == 0 ? "%.7g" : ",%.7g", embeddings[(size_t) i * n_embd + j]);
+            out.append(num, len);
+        }
+        out += "]";
+    }
+    out += "]}";
+    return out;
+}
+
+// per priority class latency percentiles of one model, plus registry counters
+static std::string server_format_stats(bert_ctx * ctx, bert_registry * registry) {
+    static const char * names[BERT_PRIORITY_COUNT] = {"interactive", "bulk"};
+
+    bert_registry_stats rstats;
+    bert_registry_get_stats(registry, &rstats);
+
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+        "{\"registry\":{\"models\":%d,\"resident\":%d,\"resident_bytes\":%lld,\"hits\":%llu,\"loads\":%llu,"
+        "\"load_failures\":%llu,\"evictions\":%llu,\"swaps\":%llu,\"load_p50_us\":%lld,\"load_max_us\":%lld}",
+        rstats.n_models, rstats.n_resident, (long long) rstats.bytes_resident, (unsigned long long) rstats.n_hits,
+        (unsigned long long) rstats.n_loads, (unsigned long long) rstats.n_load_failures, (unsigned long long) rstats.n_evictions,
+        (unsigned long long) rstats.n_swaps, (long long) bert_histogram_quantile(&rstats.load_us, 0.50), (long long) rstats.load_us.max
+    );
+    std::string out = buf;
+
+    // the rest describes the default model, if it is resident
+    if (ctx == nullptr) {
+        return out + "}";
+    }
+    out += ",\"locked_bytes\":" + std::to_string(bert_locked_bytes(ctx));
+
+    bert_memory mem;
+    bert_get_memory(ctx, &mem);
+    out += ",\"memory\":{\"weights_bytes\":" + std::to_string(mem.weights_bytes) + ",\"weights_by_type\":{";
+    bool first = true;
+    for (const auto & it : mem.weights_by_type) {
+        out += (first ? "\"" : ",\"") + it.first + "\":" + std::to_string(it.second);
+        first = false;
+    }
+    snprintf(buf, sizeof(buf),
+        "},\"weights_mapped\":%s,\"tensor_meta_bytes\":%lld,\"vocab_bytes\":%lld,\"compute_bytes\":%lld,\"compute_peak_bytes\":%lld,"
+        "\"graph_meta_bytes\":%lld,\"staging_bytes\":%lld,\"total_bytes\":%lld}",
+        mem.weights_mapped ? "true" : "false", (long long) mem.tensor_meta_bytes, (long long) mem.vocab_bytes, (long long) mem.compute_bytes,
+        (long long) mem.compute_peak_bytes, (long long) mem.graph_meta_bytes, (long long) mem.staging_bytes, (long long) mem.total_bytes
+    );
+    out += buf;
+
+    for (int p = 0; p < BERT_PRIORITY_COUNT; p++) {
+        bert_histogram hist;
+        bert_batcher_latency(ctx, (bert_priority) p, &hist);
+
+        snprintf(buf, sizeof(buf),
+            ",\"%s\":{\"requests\":%llu,\"mean_us\":%.1f,\"p50_us\":%lld,\"p95_us\":%lld,\"p99_us\":%lld,\"max_us\":%lld}",
+            names[p], (unsigned long long) hist.n, hist.n ? (double) hist.sum / hist.n : 0.0,
+            (long long) bert_histogram_quantile(&hist, 0.50), (long long) bert_histogram_quantile(&hist, 0.95),
+            (long long) bert_histogram_quantile(&hist, 0.99), (long long) hist.max
+        );
+        out += buf;
+    }
+    out += "}";
+    return out;
+}
+
+//
+// prometheus text format
+//
+
+static void server_prom_header(std::string & out, const char * name, const char * type, const char * help) {
+    out += std::string("# HELP ") + name + " " + help + "\n";
+    out += std::string("# TYPE ") + name + " " + type + "\n";
+}
+
+static void server_prom_value(std::string & out, const char * name, const std::string & labels, double value) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), " %.12g\n", value);
+    out += name;
+    out += labels.empty() ? "" : "{" + labels + "}";
+    out += buf;
+}
+
+// one bucket per power of two, scale converts the recorded unit (1e-6 for us to seconds)
+static void server_prom_histogram(std::string & out, const char * name, const std::string & labels, const bert_histogram & hist, double scale) {
+    const std::string prefix = labels.empty() ? "" : labels + ",";
+    const std::string bucket = std::string(name) + "_bucket";
+    const int n_sub = 1 << BERT_HIST_SUB_BITS;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < BERT_HIST_BUCKETS && seen < hist.n; i++) {
+        seen += hist.counts[i];
+        if ((i + 1) % n_sub == 0) {
+            char le[32];
+            snprintf(le, sizeof(le), "%.12g", bert_histogram_bucket_max(i) * scale);
+            server_prom_value(out, bucket.c_str(), prefix + "le=\"" + le + "\"", seen);
+        }
+    }
+    server_prom_value(out, bucket.c_str(), prefix + "le=\"+Inf\"", hist.n);
+    server_prom_value(out, (std::string(name) + "_sum").c_str(), labels, hist.sum * scale);
+    server_prom_value(out, (std::string(name) + "_count").c_str(), labels, hist.n);
+}
+
+static std::string server_format_metrics(bert_ctx * ctx, bert_registry * registry) {
+    std::string out;
+
+    bert_registry_stats rstats;
+    bert_registry_get_stats(registry, &rstats);
+
+    server_prom_header(out, "bert_registry_models", "gauge", "Registered models.");
+    server_prom_value(out, "bert_registry_models", "", rstats.n_models);
+    server_prom_header(out, "bert_registry_resident_models", "gauge", "Models currently loaded.");
+    server_prom_value(out, "bert_registry_resident_models", "", rstats.n_resident);
+    server_prom_header(out, "bert_registry_resident_bytes", "gauge", "Weights and compute buffers of loaded models.");
+    server_prom_value(out, "bert_registry_resident_bytes", "", rstats.bytes_resident);
+    server_prom_header(out, "bert_registry_lookups_total", "counter", "Model lookups, by whether the model was already resident.");
+    server_prom_value(out, "bert_registry_lookups_total", "result=\"hit\"", rstats.n_hits);
+    server_prom_value(out, "bert_registry_lookups_total", "result=\"load\"", rstats.n_loads);
+    server_prom_value(out, "bert_registry_lookups_total", "result=\"failure\"", rstats.n_load_failures);
+    server_prom_header(out, "bert_registry_evictions_total", "counter", "Models evicted to stay within the memory budget.");
+    server_prom_value(out, "bert_registry_evictions_total", "", rstats.n_evictions);
+    server_prom_header(out, "bert_registry_swaps_total", "counter", "Models replaced by a reload.");
+    server_prom_value(out, "bert_registry_swaps_total", "", rstats.n_swaps);
+    server_prom_header(out, "bert_registry_load_seconds", "histogram", "Model load latency, including buffer allocation and warmup.");
+    server_prom_histogram(out, "bert_registry_load_seconds", "", rstats.load_us, 1e-6);
+
+    // the rest describes the default model, if it is resident
+    if (ctx == nullptr) {
+        return out;
+    }
+
+    bert_metrics m;
+    bert_get_metrics(ctx, &m);
+    const std::string model = "model=\"" SERVER_DEFAULT_MODEL "\"";
+
+    server_prom_header(out, "bert_requests_total", "counter", "Sequences accepted by the batcher.");
+    server_prom_value(out, "bert_requests_total", model, m.n_requests);
+    server_prom_header(out, "bert_requests_dropped_total", "counter", "Sequences that never reached a batch.");
+    server_prom_value(out, "bert_requests_dropped_total", model + ",reason=\"rejected\"", m.n_rejected);
+    server_prom_value(out, "bert_requests_dropped_total", model + ",reason=\"expired\"", m.n_expired);
+    server_prom_value(out, "bert_requests_dropped_total", model + ",reason=\"cancelled\"", m.n_cancelled);
+    server_prom_header(out, "bert_queue_depth", "gauge", "Sequences waiting in the batcher.");
+    server_prom_value(out, "bert_queue_depth", model, m.n_queued);
+    server_prom_header(out, "bert_forward_total", "counter", "Forward passes.");
+    server_prom_value(out, "bert_forward_total", model, m.n_forward);
+    server_prom_header(out, "bert_sequences_total", "counter", "Sequences computed.");
+    server_prom_value(out, "bert_sequences_total", model, m.n_sequences);
+    server_prom_header(out, "bert_tokens_total", "counter", "Tokens computed, real ones and including padding.");
+    server_prom_value(out, "bert_tokens_total", model + ",kind=\"real\"", m.n_tokens);
+    server_prom_value(out, "bert_tokens_total", model + ",kind=\"padded\"", m.n_padded_tokens);
+    server_prom_header(out, "bert_batch_size", "histogram", "Sequences per forward pass.");
+    server_prom_histogram(out, "bert_batch_size", model, m.batch_size, 1.0);
+
+    server_prom_header(out, "bert_phase_seconds", "histogram", "Latency of each phase of serving a sequence.");
+    for (int i = 0; i < BERT_PHASE_COUNT; i++) {
+        const std::string labels = model + ",phase=\"" + bert_phase_name((bert_phase) i) + "\"";
+        server_prom_histogram(out, "bert_phase_seconds", labels, m.phase_us[i], 1e-6);
+    }
+
+    static const char * priorities[BERT_PRIORITY_COUNT] = {"interactive", "bulk"};
+    server_prom_header(out, "bert_request_seconds", "histogram", "Submit to embedding latency per priority class.");
+    for (int p = 0; p < BERT_PRIORITY_COUNT; p++) {
+        bert_histogram hist;
+        bert_batcher_latency(ctx, (bert_priority) p, &hist);
+        server_prom_histogram(out, "bert_request_seconds", model + ",priority=\"" + priorities[p] + "\"", hist, 1e-6);
+    }
+
+    server_prom_header(out, "bert_memory_bytes", "gauge", "Memory held by the model.");
+    server_prom_value(out, "bert_memory_bytes", model + ",kind=\"weights\"", m.weights_bytes);
+    server_prom_value(out, "bert_memory_bytes", model + ",kind=\"compute\"", m.compute_bytes);
+    server_prom_value(out, "bert_memory_bytes", model + ",kind=\"locked\"", m.locked_bytes);
+
+    return out;
+}
+
+static std::string server_json_error(const std::string & message) {
+    std::string out = "{\"error\":\"";
+    for (char c : message) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    out += "\"}";
+    return out;
+}
+
+//
+// protocol handlers
+//
+
+struct server_state {
+    server_params params;
+    bert_registry * registry = nullptr;
+
+    std::atomic<bool> stop{false};
+    std::atomic<bool> ready{false}; // default model loaded and warm
+
+    // open client sockets so shutdown can unblock them
+    std::mutex conns_mutex;
+    std::condition_variable conns_cond;
+    std::set<int> conns;
+};
+
+static bool http_respond(server_conn & conn, int status, const char * reason, const std::string & body, bool keep_alive,
+                         const char * content_type = "application/json") {
+    std::string head = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n";
+    head += std::string("Content-Type: ") + content_type + "\r\n";
+    head += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    head += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    return conn.write_all(head.data(), head.size()) && conn.write_all(body.data(), body.size());
+}
+
+static void handle_http(server_state & state, server_conn & conn) {
+    std::string line;
+    while (!state.stop && conn.read_line(line)) {
+        // request line
+        const size_t sp1 = line.find(' ');
+        const size_t sp2 = line.find(' ', sp1 + 1);
+        if (sp1 == std::string::npos || sp2 == std::string::npos) {
+            http_respond(conn, 400, "Bad Request", server_json_error("malformed request line"), false);
+            return;
+        }
+        const std::string method = line.substr(0, sp1);
+        const std::string path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        const bool http10 = line.compare(sp2 + 1, std::string::npos, "HTTP/1.0") == 0;
+
+        // headers
+        size_t content_length = 0;
+        bool bad_length = false;
+        bool keep_alive = !http10;
+        while (true) {
+            if (!conn.read_line(line)) {
+                return;
+            }
+            if (line.empty()) {
+                break;
+            }
+            const size_t colon = line.find(':');
+            if (colon == std::string::npos) {
+                continue;
+            }
+            std::string name = line.substr(0, colon);
+            std::string value = line.substr(colon + 1);
+            value.erase(0, value.find_first_not_of(' '));
+            for (auto & c : name) c = tolower(c);
+            for (auto & c : value) c = tolower(c);
+            if (name == "content-length") {
+                // client supplied, so digits only and no overflow
+                value.erase(value.find_last_not_of(' ') + 1);
+                char * end = nullptr;
+                errno = 0;
+                const unsigned long long n = strtoull(value.c_str(), &end, 10);
+                if (value.empty() || !isdigit((unsigned char) value[0]) || *end != '\0' || errno == ERANGE) {
+                    bad_length = true;
+                }
+                content_length = n;
+            } else if (name == "connection") {
+                keep_alive = value == "keep-alive" || (!http10 && value != "close");
+            }
+        }
+
+        if (bad_length) {
+            http_respond(conn, 400, "Bad Request", server_json_error("invalid content-length"), false);
+            return;
+        }
+        if (content_length > SERVER_MAX_BODY) {
+            http_respond(conn, 413, "Payload Too Large", server_json_error("request body too large"), false);
+            return;
+        }
+        std::string body(content_length, '\0');
+        if (content_length > 0 && !conn.read_exact(body.data(), content_length)) {
+            return;
+        }
+
+        bool ok;
+        if (method == "GET" && path == "/health") {
+            if (state.ready) {
+                ok = http_respond(conn, 200, "OK", "{\"status\":\"ok\"}", keep_alive);
+            } else {
+                ok = http_respond(conn, 503, "Service Unavailable", "{\"status\":\"loading\"}", keep_alive);
+            }
+        } else if (method == "GET" && path == "/stats") {
+            // scrapes must not load, refresh or count the model, so only a resident one is reported
+            std::shared_ptr<bert_ctx> ctx = bert_registry_peek(state.registry, SERVER_DEFAULT_MODEL);
+            ok = http_respond(conn, 200, "OK", server_format_stats(ctx.get(), state.registry), keep_alive);
+        } else if (method == "GET" && path == "/metrics") {
+            std::shared_ptr<bert_ctx> ctx = bert_registry_peek(state.registry, SERVER_DEFAULT_MODEL);
+            ok = http_respond(conn, 200, "OK", server_format_metrics(ctx.get(), state.registry), keep_alive, "text/plain; version=0.0.4");
+        } else if (method == "POST" && path == "/reload") {
+            // loads on this connection's thread while other clients keep being served
+            std::string model = SERVER_DEFAULT_MODEL;
+            std::string fname;
+            std::string error;
+            if (!server_parse_reload_request(body, model, fname, error)) {
+                ok = http_respond(conn, 400, "Bad Request", server_json_error(error), keep_alive);
+            } else if (!bert_registry_reload(state.registry, model, fname)) {
+                ok = http_respond(conn, 500, "Internal Server Error", server_json_error("failed to load '" + fname + "'"), keep_alive);
+            } else {
+                fprintf(stderr, "%s: model '%s' now served from %s\n", __func__, model.c_str(), fname.c_str());
+                ok = http_respond(conn, 200, "OK", "{\"status\":\"ok\"}", keep_alive);
+            }
+        } else if (method == "POST" && path == "/embed") {
+            bert_strings texts;
+            std::string model = SERVER_DEFAULT_MODEL;
+            bert_request_params rparams;
+            std::string error;
+            std::shared_ptr<bert_ctx> ctx;
+            if (!server_parse_embed_request(body, texts, model, rparams, error)) {
+                ok = http_respond(conn, 400, "Bad Request", server_json_error(error), keep_alive);
+            } else if (!(ctx = bert_registry_get(state.registry, model))) {
+                ok = http_respond(conn, 404, "Not Found", server_json_error("model '" + model + "' is unknown or failed to load"), keep_alive);
+            } else {
+                bert_trace_span span("embed_request", "server");
+                span.arg("texts", texts.size());
+                const int64_t t_start_us = ggml_time_us();
+                bert_batch batch;
+                for (const auto & text : texts) {
+                    batch.push_back(bert_tokenize(ctx.get(), text, ctx->buf_n_max_tokens));
+                }
+                bert_metrics_observe_phase(ctx.get(), BERT_PHASE_TOKENIZE, ggml_time_us() - t_start_us);
+                std::vector<float> embeddings;
+                const bert_status status = server_embed(ctx.get(), conn.fd, batch, rparams, embeddings);
+                switch (status) {
+                    case BERT_STATUS_OK: {
+                        const int32_t n_embd = bert_n_embd(ctx.get());
+                        ok = http_respond(conn, 200, "OK", server_format_embeddings(embeddings, texts.size(), n_embd), keep_alive);
+                    } break;
+                    case BERT_STATUS_REJECTED: {
+                        ok = http_respond(conn, 503, "Service Unavailable", server_json_error("server overloaded"), keep_alive);
+                    } break;
+                    case BERT_STATUS_EXPIRED: {
+                        ok = http_respond(conn, 504, "Gateway Timeout", server_json_error("deadline exceeded"), keep_alive);
+                    } break;
+                    case BERT_STATUS_CANCELLED: {
+                        ok = false; // the client is gone
+                    } break;
+                    default: {
+                        ok = http_respond(conn, 400, "Bad Request", server_json_error("invalid request"), keep_alive);
+                    } break;
+                }
+            }
+        } else {
+            ok = http_respond(conn, 404, "Not Found", server_json_error("unknown endpoint"), keep_alive);
+        }
+
+        if (!ok || !keep_alive) {
+            return;
+        }
+    }
+}
+
+static void handle_binary(server_state & state, server_conn & conn) {
+    char magic[4];
+    while (!state.stop && conn.read_exact(magic, sizeof(magic))) {
+        uint32_t header[2];
+        if (memcmp(magic, SERVER_MAGIC, 4) != 0 || !conn.read_exact(header, sizeof(header))) {
+            return;
+        }
+        const uint32_t kind = header[0] & ~SERVER_FLAG_BULK;
+        const uint32_t n_items = header[1];
+        bert_request_params rparams;
+        rparams.priority = header[0] & SERVER_FLAG_BULK ? BERT_PRIORITY_BULK : BERT_PRIORITY_INTERACTIVE;
+        if (kind != SERVER_KIND_TEXT && kind != SERVER_KIND_TOKENS) {
+            return;
+        }
+        // every item costs at least its length prefix, so the whole request shares the http body limit
+        if (n_items > SERVER_MAX_BODY / sizeof(uint32_t)) {
+            return;
+        }
+
+        bert_trace_span span("binary_request", "server");
+        span.arg("items", n_items);
+
+        // the binary protocol always talks to the default model
+        std::shared_ptr<bert_ctx> ctx = bert_registry_get(state.registry, SERVER_DEFAULT_MODEL);
+        if (!ctx) {
+            return;
+        }
+        const int32_t n_embd = bert_n_embd(ctx.get());
+        const int32_t n_max_tokens = ctx->buf_n_max_tokens;
+        const int32_t n_vocab = bert_n_vocab(ctx.get());
+
+        // grown as items arrive so the allocation follows the bytes actually sent, not the claimed count
+        bert_batch batch;
+        bool valid = true;
+        size_t n_body = 0;
+        int64_t t_tokenize_us = 0;
+        std::string text;
+        for (uint32_t i = 0; i < n_items; i++) {
+            uint32_t len;
+            if (!conn.read_exact(&len, sizeof(len))) {
+                return;
+            }
+            const size_t n_payload = kind == SERVER_KIND_TEXT ? len : (size_t) len * sizeof(bert_token);
+            n_body += sizeof(len) + n_payload;
+            if (n_body > SERVER_MAX_BODY) {
+                return;
+            }
+            if (kind == SERVER_KIND_TEXT) {
+                text.resize(len);
+                if (!conn.read_exact(text.data(), len)) {
+                    return;
+                }
+                // only the tokenizer is timed, not the reads in between
+                const int64_t t_start_us = ggml_time_us();
+                batch.push_back(bert_tokenize(ctx.get(), text, n_max_tokens));
+                t_tokenize_us += ggml_time_us() - t_start_us;
+            } else {
+                bert_tokens tokens(len);
+                if (!conn.read_exact(tokens.data(), n_payload)) {
+                    return;
+                }
+                valid = valid && len > 0 && (int32_t) len <= n_max_tokens;
+                for (bert_token id : tokens) {
+                    valid = valid && id >= 0 && id < n_vocab;
+                }
+                batch.push_back(std::move(tokens));
+            }
+        }
+
+        if (kind == SERVER_KIND_TEXT) {
+            bert_metrics_observe_phase(ctx.get(), BERT_PHASE_TOKENIZE, t_tokenize_us);
+        }
+
+        std::vector<float> embeddings;
+        const bert_status status = valid ? server_embed(ctx.get(), conn.fd, batch, rparams, embeddings) : BERT_STATUS_INVALID;
+        const bool ok = status == BERT_STATUS_OK;
+        const uint32_t reply[3] = {
+            (uint32_t) status,
+            ok ? n_items : 0,
+            (uint32_t) n_embd,
+        };
+        if (!conn.write_all(reply, sizeof(reply))) {
+            return;
+        }
+        if (ok && !conn.write_all(embeddings.data(), embeddings.size() * sizeof(float))) {
+            return;
+        }
+    }
+}
+
+static void handle_conn(server_state * state, int fd) {
+    server_conn conn = {fd, {}};
+    bert_trace_thread_name("connection");
+
+    // sniff the protocol from the first bytes
+    if (conn.peek(4)) {
+        if (memcmp(conn.buf.data(), SERVER_MAGIC, 4) == 0) {
+            handle_binary(*state, conn);
+        } else {
+            handle_http(*state, conn);
+        }
+    }
+
+    close(fd);
+    std::lock_guard<std::mutex> lock(state->conns_mutex);
+    state->conns.erase(fd);
+    state->conns_cond.notify_all();
+}
+
+#ifdef __linux__
+//
+// shared memory transport
+//
+
+static void shm_loop(server_state * state, bert_shm_ring ring) {
+    bert_shm_header * header = ring.header;
+    const uint32_t n_slots = ring.n_slots;
+    const uint32_t slot_size = ring.slot_size;
+    const uint32_t n_embd_ring = ring.n_embd;
+    uint32_t cursor = 0;
+    bert_trace_thread_name("shm");
+
+    while (!state->stop) {
+        // read the doorbell before scanning so a submission during the scan is never missed
+        const uint32_t bell = header->doorbell.load(std::memory_order_acquire);
+
+        bool found = false;
+        for (uint32_t k = 0; k < n_slots; k++) {
+            const uint32_t i = (cursor + k) % n_slots;
+            bert_shm_slot * slot = bert_shm_get_slot(header, slot_size, i);
+            uint32_t expected = BERT_SHM_READY;
+            if (!slot->state.compare_exchange_strong(expected, BERT_SHM_BUSY, std::memory_order_acquire)) {
+                continue;
+            }
+            found = true;
+            cursor = i + 1;
+
+            // the ring is sized for the default model
+            std::shared_ptr<bert_ctx> ctx = bert_registry_get(state->registry, SERVER_DEFAULT_MODEL);
+            if (!ctx) {
+                bert_shm_complete(slot, BERT_STATUS_INVALID, 0);
+                continue;
+            }
+            const int32_t n_max_tokens = std::min<int32_t>(ctx->buf_n_max_tokens, ring.n_max_tokens);
+
+            // tokenize straight out of the slot, reading the client's fields once
+            const uint8_t * payload = bert_shm_payload(slot);
+            const uint32_t slot_kind = slot->kind;
+            const uint32_t len = slot->len;
+            const uint32_t kind = slot_kind & ~BERT_SHM_FLAG_BULK;
+            bert_request_params rparams;
+            rparams.priority = slot_kind & BERT_SHM_FLAG_BULK ? BERT_PRIORITY_BULK : BERT_PRIORITY_INTERACTIVE;
+            bert_tokens tokens;
+            bool valid = true;
+            if (kind == BERT_SHM_KIND_TEXT && len <= slot_size) {
+                const int64_t t_start_us = ggml_time_us();
+                tokens = bert_tokenize(ctx.get(), std::string((const char *) payload, len), n_max_tokens);
+                bert_metrics_observe_phase(ctx.get(), BERT_PHASE_TOKENIZE, ggml_time_us() - t_start_us);
+            } else if (kind == BERT_SHM_KIND_TOKENS && (size_t) len * sizeof(bert_token) <= slot_size) {
+                const bert_token * ids = (const bert_token *) payload;
+                tokens.assign(ids, ids + len);
+                const int32_t n_vocab = bert_n_vocab(ctx.get());
+                for (bert_token id : tokens) {
+                    valid = valid && id >= 0 && id < n_vocab;
+                }
+            }
+            if (!valid || tokens.empty() || (int32_t) tokens.size() > n_max_tokens) {
+                bert_shm_complete(slot, BERT_STATUS_INVALID, 0);
+                continue;
+            }
+
+            // the embedding is written back into the same slot, unless a reload changed its size
+            bert_status status = bert_batcher_submit(ctx.get(), std::move(tokens), [slot, n_embd_ring](bert_status status, const float * embedding, int32_t n_embd) {
+                if (status == BERT_STATUS_OK && (uint32_t) n_embd != n_embd_ring) {
+                    status = BERT_STATUS_INVALID;
+                }
+                if (status != BERT_STATUS_OK) {
+                    bert_shm_complete(slot, status, 0);
+                    return;
+                }
+                memcpy(bert_shm_payload(slot), embedding, n_embd * sizeof(float));
+                bert_shm_complete(slot, BERT_STATUS_OK, n_embd);
+            }, rparams);
+            if (status != BERT_STATUS_OK) {
+                bert_shm_complete(slot, status, 0);
+            }
+        }
+
+        if (!found) {
+            bert_shm_futex_wait(&header->doorbell, bell, 200000);
+        }
+    }
+}
+#endif
+
+//
+// listeners
+//
+
+static int listen_unix(const char * path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        close(fd);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_tcp(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // localhost only, this is not meant to face the network
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void accept_loop(server_state * state, int listen_fd) {
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    while (!state->stop) {
+        // wake up periodically to notice shutdown
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(state->conns_mutex);
+            state->conns.insert(fd);
+        }
+        std::thread(handle_conn, state, fd).detach();
+    }
+    close(listen_fd);
+}
+
+// unblock idle clients and wait for in-flight requests, call once the listeners have stopped
+static void drain_conns(server_state * state) {
+    std::unique_lock<std::mutex> lock(state->conns_mutex);
+    for (int fd : state->conns) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    state->conns_cond.wait(lock, [&] { return state->conns.empty(); });
+}
+
+static std::atomic<bool> * g_stop = nullptr;
+
+static void on_signal(int) {
+    if (g_stop) {
+        *g_stop = true;
+    }
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    server_state state;
+    server_params & params = state.params;
+    if (server_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    // before any model loads, so loading and warmup show up too
+    if (params.trace) {
+        bert_trace_params tparams;
+        tparams.nodes = params.trace_ops;
+        bert_trace_start(tparams);
+        bert_trace_thread_name("main");
+    }
+
+    // every model gets buffers for the largest batch we will form and its own batcher
+    bert_registry_params rparams;
+    rparams.load.use_cpu = params.use_cpu;
+    rparams.load.use_mmap = params.use_mmap;
+    rparams.load.use_mlock = params.use_mlock;
+    rparams.load.mlock_compute = params.use_mlock;
+    rparams.load.stream_layers = params.stream_layers;
+    rparams.memory_budget = (int64_t) params.memory_budget_mb * 1024 * 1024;
+    rparams.batch_size = params.batch_size;
+    rparams.batcher.n_threads = params.n_threads;
+    rparams.batcher.max_batch_tokens = params.max_batch_tokens;
+    rparams.batcher.max_delay_us = params.max_delay_us;
+    rparams.batcher.interactive_max_batch_tokens = params.interactive_max_batch_tokens;
+    rparams.batcher.interactive_max_delay_us = params.interactive_max_delay_us;
+    rparams.batcher.max_queue_delay_us = params.max_queue_delay_us;
+    rparams.warmup = params.warmup;
+    rparams.warmup_params.seq_lens = params.warmup_lens;
+    rparams.warmup_params.n_threads = params.n_threads;
+    state.registry = bert_registry_new(rparams);
+
+    bert_registry_add(state.registry, SERVER_DEFAULT_MODEL, params.model);
+    for (const auto & model : params.models) {
+        bert_registry_add(state.registry, model.first, model.second);
+    }
+
+    g_stop = &state.stop;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    // open listeners
+    std::vector<std::thread> listeners;
+
+    // error exits must join the threads already started, or their destructors terminate
+    auto fail = [&]() {
+        state.stop = true;
+        for (auto & t : listeners) {
+            t.join();
+        }
+        drain_conns(&state);
+        bert_registry_free(state.registry);
+        return 1;
+    };
+    if (params.socket_path) {
+        int fd = listen_unix(params.socket_path);
+        if (fd < 0) {
+            fprintf(stderr, "%s: failed to listen on '%s': %s\n", __func__, params.socket_path, strerror(errno));
+            return fail();
+        }
+        fprintf(stderr, "%s: listening on unix:%s\n", __func__, params.socket_path);
+        listeners.emplace_back(accept_loop, &state, fd);
+    }
+    if (params.port > 0) {
+        int fd = listen_tcp(params.port);
+        if (fd < 0) {
+            fprintf(stderr, "%s: failed to listen on port %d: %s\n", __func__, params.port, strerror(errno));
+            return fail();
+        }
+        fprintf(stderr, "%s: listening on http://127.0.0.1:%d\n", __func__, params.port);
+        listeners.emplace_back(accept_loop, &state, fd);
+    }
+
+    // load and warm the default model up front, the others on first use. the
+    // listeners are already up so /health can report that we are not ready yet
+    std::shared_ptr<bert_ctx> default_ctx = bert_registry_get(state.registry, SERVER_DEFAULT_MODEL);
+    if (!default_ctx) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model);
+        return fail();
+    }
+    state.ready = true;
+    fprintf(stderr, "%s: ready\n", __func__);
+
+#ifdef __linux__
+    bert_shm_ring shm;
+    if (params.shm_name) {
+        const uint32_t n_embd = bert_n_embd(default_ctx.get());
+        const uint32_t n_max_tokens = default_ctx->buf_n_max_tokens;
+        const uint32_t slot_size = std::max<uint32_t>(
+            params.shm_slot_bytes, std::max<uint32_t>(n_embd * sizeof(float), n_max_tokens * sizeof(bert_token))
+        );
+        shm = bert_shm_create(params.shm_name, params.shm_slots, slot_size, n_embd, n_max_tokens);
+        if (shm.header == nullptr) {
+            fprintf(stderr, "%s: failed to create shared memory '%s': %s\n", __func__, params.shm_name, strerror(errno));
+            default_ctx.reset();
+            return fail();
+        }
+        fprintf(stderr, "%s: serving shared memory %s (%d slots of %u bytes)\n", __func__, params.shm_name, params.shm_slots, slot_size);
+        listeners.emplace_back(shm_loop, &state, shm);
+    }
+#endif
+    if (listeners.empty()) {
+        fprintf(stderr, "%s: nothing to listen on\n", __func__);
+        default_ctx.reset();
+        return fail();
+    }
+
+    // from here on the registry alone decides whether the default model stays resident
+    default_ctx.reset();
+
+    for (auto & t : listeners) {
+        t.join();
+    }
+
+    drain_conns(&state);
+
+    if (params.socket_path) {
+        unlink(params.socket_path);
+    }
+    bert_registry_free(state.registry);
+
+    // only unmap once the batcher has written back every pending slot
+#ifdef __linux__
+    if (shm.header) {
+        bert_shm_destroy(params.shm_name, shm);
+    }
+#endif
+
+    if (params.trace && bert_trace_stop(params.trace)) {
+        fprintf(stderr, "%s: trace written to %s\n", __func__, params.trace);
+    }
+
+    return 0;
+}
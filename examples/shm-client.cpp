@@ -0,0 +1,78 @@
+#include "server-shm.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+struct shm_client_params
+{
+    const char* shm_name = "/bert";
+    std::vector<std::string> prompts;
+};
+
+void shm_client_print_usage(char **argv, const shm_client_params &params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  --shm NAME            shared memory ring served by the server (default: %s)\n", params.shm_name);
+    fprintf(stderr, "  -p PROMPT, --prompt PROMPT\n");
+    fprintf(stderr, "                        text to embed, may be repeated\n");
+    fprintf(stderr, "\n");
+}
+
+bool shm_client_params_parse(int argc, char **argv, shm_client_params &params) {
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--shm") {
+            params.shm_name = argv[++i];
+        } else if (arg == "-p" || arg == "--prompt") {
+            params.prompts.push_back(argv[++i]);
+        } else if (arg == "-h" || arg == "--help") {
+            shm_client_print_usage(argv, params);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            shm_client_print_usage(argv, params);
+            exit(0);
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    shm_client_params params;
+    if (shm_client_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    bert_shm_header * header = bert_shm_open(params.shm_name);
+    if (header == nullptr) {
+        fprintf(stderr, "%s: failed to open shared memory '%s', is the server running with --shm?\n", __func__, params.shm_name);
+        return 1;
+    }
+
+    const uint32_t n_embd = header->n_embd;
+    std::vector<float> embed(n_embd);
+
+    for (const auto & prompt : params.prompts) {
+        if (!bert_shm_embed(header, BERT_SHM_KIND_TEXT, prompt.data(), prompt.size(), embed.data())) {
+            fprintf(stderr, "%s: failed to embed '%s'\n", __func__, prompt.c_str());
+            continue;
+        }
+
+        printf("[ ");
+        for (uint32_t i = 0; i < n_embd; i++) {
+            const char * sep = (i == n_embd - 1) ? "" : ",";
+            printf("%1.4f%s ", embed[i], sep);
+        }
+        printf("]\n");
+    }
+
+    bert_shm_close(header);
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+import sys
+import json
+
+from pathlib import Path
+
+# primary usage
+if len(sys.argv) < 2:
+    print('Usage: convert-beir.py beir_dataset_dir [split]\n')
+    print('Writes queries.tsv, corpus.tsv and qrels.tsv next to the BEIR jsonl files, in the format eval-retrieval reads.')
+    print('The split defaults to test.')
+    sys.exit(1)
+
+data_dir = Path(sys.argv[1])
+split = sys.argv[2] if len(sys.argv) > 2 else 'test'
+
+# check inputs exist
+for path in [data_dir / 'queries.jsonl', data_dir / 'corpus.jsonl', data_dir / 'qrels' / f'{split}.tsv']:
+    if not path.exists():
+        print(f'File {path} does not exist.')
+        sys.exit(1)
+
+# one "id<tab>text" per line, so tabs and newlines inside texts become spaces
+def clean(text):
+    return ' '.join(text.split())
+
+def convert(name, with_title):
+    n = 0
+    with open(data_dir / f'{name}.jsonl', encoding='utf-8') as fin, open(data_dir / f'{name}.tsv', 'w', encoding='utf-8') as fout:
+        for line in fin:
+            item = json.loads(line)
+            text = item.get('text', '')
+            if with_title and item.get('title'):
+                text = item['title'] + ' ' + text
+            fout.write(f"{clean(item['_id'])}\t{clean(text)}\n")
+            n += 1
+    print(f'Wrote {n} {name} to {data_dir / name}.tsv')
+
+convert('queries', False)
+convert('corpus', True)
+
+# the beir qrels are already query-id, corpus-id, score
+(data_dir / 'qrels.tsv').write_text((data_dir / 'qrels' / f'{split}.tsv').read_text(encoding='utf-8'), encoding='utf-8')
+print(f'Wrote {data_dir / "qrels.tsv"}')
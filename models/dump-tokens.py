@@ -0,0 +1,41 @@
+import sys
+
+from pathlib import Path
+from transformers import AutoConfig, AutoTokenizer
+
+# primary usage
+if len(sys.argv) < 3:
+    print('Usage: dump-tokens.py model_dir corpus.txt [output.txt]\n')
+    print('Writes the Hugging Face token ids of every corpus line, space separated, one line per input line.')
+    print('Feed the result to bench-tokenizer --reference to compare against bert_tokenize.')
+    sys.exit(1)
+
+model_dir = Path(sys.argv[1])
+corpus_path = Path(sys.argv[2])
+output_path = Path(sys.argv[3]) if len(sys.argv) > 3 else corpus_path.with_suffix('.tokens')
+
+# check inputs exist
+if not model_dir.exists():
+    print(f'Directory {model_dir} does not exist.')
+    sys.exit(1)
+if not corpus_path.exists():
+    print(f'Corpus {corpus_path} does not exist.')
+    sys.exit(1)
+
+# same truncation as bert_tokenize, which stops at max_position_embedding tokens
+tokenizer = AutoTokenizer.from_pretrained(model_dir)
+config = AutoConfig.from_pretrained(model_dir)
+max_length = config.max_position_embeddings
+
+# split exactly like std::getline so line numbers agree
+with open(corpus_path, 'r', encoding='utf-8', newline='') as f:
+    lines = f.read().split('\n')
+if lines and lines[-1] == '':
+    lines.pop()
+
+with open(output_path, 'w', encoding='utf-8') as f:
+    for line in lines:
+        ids = tokenizer(line, truncation=True, max_length=max_length)['input_ids']
+        f.write(' '.join(str(i) for i in ids) + '\n')
+
+print(f'Wrote {len(lines)} tokenized lines to {output_path}')